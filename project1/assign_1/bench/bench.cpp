@@ -0,0 +1,418 @@
+//
+// bench.cpp
+//
+// The benchmark suite behind "make bench".  It writes a fixed set of
+// procedurally generated scenes (the same ones on every run: the random
+// numbers come from a fixed seed), renders each with the command line
+// ray tracer, and reports wall time, rays per second and peak memory.
+//
+// Results are compared with a saved baseline: a scene that got slower,
+// or bigger, by more than the tolerance is flagged and the exit status
+// is non-zero.  The ray counts are compared too, since a change in them
+// means the renderer no longer does the same work and the timings are
+// not comparable.
+//
+// usage: bench [options]
+//   -ray <path>       ray tracer to run (default ./ray)
+//   -dir <path>       where to write scenes and images (default bench/out)
+//   -baseline <file>  baseline results (default bench/baseline.txt)
+//   -tolerance <%>    allowed slowdown before flagging (default 10)
+//   -repeat <#>       renders per scene, best time is kept (default 3)
+//   -j <#>            render threads (default: the ray tracer's)
+//   -save             write the results as the new baseline
+//   -only <name>      run just the named scene
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/fileio/bitmap.h"
+
+using namespace std;
+
+// Deterministic on every platform, unlike rand() or <random>'s
+// distributions.
+class Random {
+public:
+  explicit Random(unsigned int seed) : state(seed) {}
+  double next() {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) * (1.0 / 16777216.0);
+  }
+  double range(double lo, double hi) { return lo + (hi - lo) * next(); }
+private:
+  unsigned int state;
+};
+
+struct BenchScene {
+  const char* name;
+  const char* description;
+  int width;
+  int depth;
+  bool cubeMap;
+  void (*write)(ostream& out);
+};
+
+struct BenchResult {
+  BenchResult() : seconds(0), renderSeconds(0), mraysPerSecond(0), peakKB(0), rays(0) {}
+  double seconds;         // wall time of the whole run: parse, build and render
+  double renderSeconds;
+  double mraysPerSecond;
+  long peakKB;
+  long long rays;
+};
+
+static const char* MATTE = "{ diffuse = (0.7,0.7,0.7); ambient = (0.7,0.7,0.7); specular = (0.2,0.2,0.2); shininess = 20; }";
+static const char* MIRROR = "{ diffuse = (0.1,0.1,0.1); reflective = (0.8,0.8,0.8); specular = (1,1,1); shininess = 100; }";
+static const char* GLASS = "{ diffuse = (0.05,0.05,0.05); transmissive = (0.9,0.9,0.9); index = 1.5; specular = (1,1,1); shininess = 100; }";
+
+static void writeHeader(ostream& out, double distance) {
+  out << "SBT-raytracer 1.0\n";
+  out << "camera { position = (0,0," << distance << "); viewdir = (0,0,-1); updir = (0,1,0); aspectratio = 1; }\n";
+}
+
+// Point lights default to 1/d^2 falloff, far too dark for these scenes.
+static void writePointLight(ostream& out, double x, double y, double z, double intensity) {
+  out << "point_light { position = (" << x << "," << y << "," << z << "); colour = ("
+      << intensity << "," << intensity << "," << intensity
+      << "); constant_attenuation_coeff = 1; linear_attenuation_coeff = 0; quadratic_attenuation_coeff = 0.01; }\n";
+}
+
+static void writeSphere(ostream& out, double x, double y, double z, double r, const string& material) {
+  out << "translate(" << x << "," << y << "," << z << ", scale(" << r
+      << ", sphere { material = " << material << "; }));\n";
+}
+
+static string randomColour(Random& rnd) {
+  ostringstream s;
+  s << "(" << rnd.range(0.2, 1) << "," << rnd.range(0.2, 1) << "," << rnd.range(0.2, 1) << ")";
+  return s.str();
+}
+
+// Lots of small objects: stresses the scene kd-tree.
+static void writeSpheres(ostream& out) {
+  Random rnd(1);
+  writeHeader(out, 8);
+  writePointLight(out, 4, 6, 8, 1);
+  out << "directional_light { direction = (-1,-1,-1); colour = (0.4,0.4,0.4); }\n";
+  out << "ambient_light { colour = (0.1,0.1,0.1); }\n";
+  for(int i = 0; i < 4000; ++i) {
+    string colour = randomColour(rnd);
+    string m = "{ diffuse = " + colour + "; ambient = " + colour + "; specular = (0.4,0.4,0.4); shininess = 30; }";
+    writeSphere(out, rnd.range(-4, 4), rnd.range(-4, 4), rnd.range(-6, 2), rnd.range(0.03, 0.12), m);
+  }
+}
+
+// One big mesh: stresses the mesh kd-tree and the triangle tests.
+static void writeTrimesh(ostream& out) {
+  const int rings = 384, sides = 256;   // 196608 triangles
+  writeHeader(out, 5);
+  writePointLight(out, 3, 4, 5, 1);
+  out << "ambient_light { colour = (0.1,0.1,0.1); }\n";
+  out << "rotate(1,0,0,0.9, trimesh {\n points = (";
+  for(int i = 0; i < rings; ++i) {
+    double u = 2 * M_PI * i / rings;
+    for(int j = 0; j < sides; ++j) {
+      double v = 2 * M_PI * j / sides;
+      // a torus with a rippled tube
+      double r = 0.5 + 0.05 * sin(7 * u) * cos(5 * v);
+      double x = (1.4 + r * cos(v)) * cos(u);
+      double y = (1.4 + r * cos(v)) * sin(u);
+      double z = r * sin(v);
+      out << (i || j ? "," : "") << "(" << x << "," << y << "," << z << ")";
+    }
+    out << "\n";
+  }
+  out << ");\n faces = (";
+  for(int i = 0; i < rings; ++i) {
+    for(int j = 0; j < sides; ++j) {
+      int a = i * sides + j;
+      int b = ((i + 1) % rings) * sides + j;
+      int c = ((i + 1) % rings) * sides + (j + 1) % sides;
+      int d = i * sides + (j + 1) % sides;
+      out << (i || j ? "," : "") << "(" << a << "," << b << "," << c << "),(" << a << "," << c << "," << d << ")";
+    }
+    out << "\n";
+  }
+  out << ");\n gennormals;\n material = " << MATTE << ";\n});\n";
+}
+
+// Mirrors and glass inside a mirrored box, rendered deep.
+static void writeDeep(ostream& out) {
+  Random rnd(2);
+  writeHeader(out, 3.5);
+  writePointLight(out, 0, 1.5, 1, 1);
+  out << "ambient_light { colour = (0.1,0.1,0.1); }\n";
+  out << "scale(8, box { material = " << MIRROR << "; });\n";
+  for(int i = 0; i < 24; ++i) {
+    writeSphere(out, rnd.range(-1.5, 1.5), rnd.range(-1.5, 1.5), rnd.range(-3.5, 0),
+                rnd.range(0.2, 0.5), i % 2 ? MIRROR : GLASS);
+  }
+}
+
+// Many lights: stresses shading and shadow rays.
+static void writeLights(ostream& out) {
+  Random rnd(3);
+  writeHeader(out, 8);
+  for(int i = 0; i < 64; ++i) {
+    writePointLight(out, rnd.range(-6, 6), rnd.range(2, 6), rnd.range(-4, 6), 0.05);
+  }
+  out << "ambient_light { colour = (0.1,0.1,0.1); }\n";
+  out << "translate(0,-2.5,-2, scale(12, rotate(1,0,0,-1.5708, square { material = " << MATTE << "; })));\n";
+  for(int i = 0; i < 200; ++i) {
+    writeSphere(out, rnd.range(-4, 4), rnd.range(-2, 3), rnd.range(-6, 1), rnd.range(0.1, 0.4), MATTE);
+  }
+}
+
+// Texture lookups on every shading point.
+static void writeTextures(ostream& out) {
+  Random rnd(4);
+  writeHeader(out, 8);
+  writePointLight(out, 4, 6, 8, 1);
+  out << "ambient_light { colour = (0.2,0.2,0.2); }\n";
+  for(int i = 0; i < 600; ++i) {
+    out << "translate(" << rnd.range(-4, 4) << "," << rnd.range(-4, 4) << "," << rnd.range(-6, 1)
+        << ", rotate(" << rnd.range(-1, 1) << "," << rnd.range(-1, 1) << ",1," << rnd.range(0, 3)
+        << ", scale(" << rnd.range(0.3, 0.8) << ", " << (i % 2 ? "box" : "square")
+        << " { material = { diffuse = map(\"texture.bmp\"); ambient = (0.3,0.3,0.3); specular = (0.3,0.3,0.3); shininess = 20; }; })));\n";
+  }
+}
+
+// Reflective objects against an environment cube map.
+static void writeCubeMapped(ostream& out) {
+  Random rnd(5);
+  writeHeader(out, 6);
+  out << "directional_light { direction = (-1,-1,-1); colour = (0.6,0.6,0.6); }\n";
+  out << "ambient_light { colour = (0.1,0.1,0.1); }\n";
+  for(int i = 0; i < 80; ++i) {
+    writeSphere(out, rnd.range(-3, 3), rnd.range(-3, 3), rnd.range(-4, 0),
+                rnd.range(0.2, 0.6), i % 4 ? MIRROR : GLASS);
+  }
+}
+
+static const BenchScene SCENES[] = {
+  { "spheres",  "4000 spheres",                   500, 3,  false, writeSpheres },
+  { "trimesh",  "196608 triangle mesh",           300, 3,  false, writeTrimesh },
+  { "deep",     "mirrors and glass, depth 10",    200, 10, false, writeDeep },
+  { "lights",   "64 point lights",                200, 2,  false, writeLights },
+  { "textures", "600 textured boxes and squares", 300, 2,  false, writeTextures },
+  { "cubemap",  "reflections of a cube map",      500, 5,  true,  writeCubeMapped },
+};
+static const int NUM_SCENES = sizeof(SCENES) / sizeof(SCENES[0]);
+
+// A checkerboard with a colour gradient, so filtering has work to do.
+static void writeTexture(const string& fileName, int size, int seed) {
+  vector<unsigned char> data(size * size * 3);
+  for(int y = 0; y < size; ++y) {
+    for(int x = 0; x < size; ++x) {
+      bool check = ((x / 16) + (y / 16) + seed) % 2;
+      unsigned char* p = &data[(y * size + x) * 3];
+      p[0] = check ? 255 * x / size : 40;
+      p[1] = check ? 255 * y / size : 40 + 30 * seed;
+      p[2] = check ? 200 : 255 * (size - x) / size;
+    }
+  }
+  writeBMP(fileName.c_str(), size, size, &data[0]);
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+// The number after "key": in the renderer's stats file.  Good enough for
+// the flat, known layout that CommandLineUI::writeStats produces.
+static bool jsonNumber(const string& json, const string& key, double& value) {
+  size_t p = json.find("\"" + key + "\":");
+  if(p == string::npos) return false;
+  value = atof(json.c_str() + p + key.size() + 3);
+  return true;
+}
+
+static bool readFile(const string& fileName, string& contents) {
+  ifstream in(fileName.c_str());
+  if(!in) return false;
+  ostringstream s;
+  s << in.rdbuf();
+  contents = s.str();
+  return true;
+}
+
+static bool runScene(const BenchScene& scene, const string& rayPath, const string& dir,
+                     int threads, BenchResult& result) {
+  string base = dir + "/" + scene.name;
+  ostringstream cmd;
+  cmd << rayPath << " -r " << scene.depth << " -w " << scene.width << " -s " << base << ".json";
+  if(threads > 0) cmd << " -j " << threads;
+  if(scene.cubeMap) cmd << " -c " << dir << "/cubemap";
+  cmd << " " << base << ".ray " << base << ".bmp > " << base << ".log 2>&1";
+
+  double start = now();
+  int status = system(cmd.str().c_str());
+  result.seconds = now() - start;
+
+  string json;
+  double total = 0, rate = 0, render = 0, rss = 0;
+  if(status != 0 || !readFile(base + ".json", json) ||
+     !jsonNumber(json, "total", total) || !jsonNumber(json, "mrays_per_second", rate) ||
+     !jsonNumber(json, "seconds", render) || !jsonNumber(json, "peak_rss_kb", rss)) {
+    cerr << scene.name << ": render failed, see " << base << ".log" << endl;
+    return false;
+  }
+  result.rays = (long long)total;
+  result.mraysPerSecond = rate;
+  result.renderSeconds = render;
+  result.peakKB = (long)rss;
+  return true;
+}
+
+// The baseline is one line per scene:
+//   name seconds render_seconds mrays_per_second peak_rss_kb rays
+static bool readBaseline(const string& fileName, map<string, BenchResult>& baseline) {
+  ifstream in(fileName.c_str());
+  if(!in) return false;
+  string line;
+  while(getline(in, line)) {
+    if(line.empty() || line[0] == '#') continue;
+    istringstream s(line);
+    string name;
+    BenchResult r;
+    if(s >> name >> r.seconds >> r.renderSeconds >> r.mraysPerSecond >> r.peakKB >> r.rays) {
+      baseline[name] = r;
+    }
+  }
+  return true;
+}
+
+static bool writeBaseline(const string& fileName, const map<string, BenchResult>& results) {
+  ofstream out(fileName.c_str());
+  if(!out) return false;
+  out << "# name seconds render_seconds mrays_per_second peak_rss_kb rays\n";
+  for(map<string, BenchResult>::const_iterator i = results.begin(); i != results.end(); ++i) {
+    const BenchResult& r = i->second;
+    out << i->first << " " << r.seconds << " " << r.renderSeconds << " " << r.mraysPerSecond
+        << " " << r.peakKB << " " << r.rays << "\n";
+  }
+  return bool(out);
+}
+
+// Relative change from base to value, in percent.
+static double change(double value, double base) {
+  return base > 0 ? 100.0 * (value - base) / base : 0.0;
+}
+
+static void usage(const char* prog) {
+  cerr << "usage: " << prog << " [-ray path] [-dir path] [-baseline file] [-tolerance %]"
+       << " [-repeat #] [-j #] [-save] [-only name]" << endl;
+}
+
+int main(int argc, char** argv) {
+  string rayPath = "./ray", dir = "bench/out", baselineName = "bench/baseline.txt", only;
+  double tolerance = 10;
+  int repeat = 3, threads = 0;
+  bool save = false;
+
+  for(int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if(arg == "-save") save = true;
+    else if(arg == "-ray" && hasValue) rayPath = argv[++i];
+    else if(arg == "-dir" && hasValue) dir = argv[++i];
+    else if(arg == "-baseline" && hasValue) baselineName = argv[++i];
+    else if(arg == "-tolerance" && hasValue) tolerance = atof(argv[++i]);
+    else if(arg == "-repeat" && hasValue) repeat = max(1, atoi(argv[++i]));
+    else if(arg == "-j" && hasValue) threads = atoi(argv[++i]);
+    else if(arg == "-only" && hasValue) only = argv[++i];
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  mkdir(dir.c_str(), 0755);
+  mkdir((dir + "/cubemap").c_str(), 0755);
+  writeTexture(dir + "/texture.bmp", 512, 0);
+  static const char* faces[6] = { "xpos", "xneg", "ypos", "yneg", "zpos", "zneg" };
+  for(int f = 0; f < 6; ++f) writeTexture(dir + "/cubemap/" + faces[f] + ".bmp", 256, f);
+
+  map<string, BenchResult> baseline;
+  bool haveBaseline = readBaseline(baselineName, baseline);
+  if(!save && !haveBaseline) {
+    cout << "no baseline in " << baselineName << "; run with -save to record one" << endl;
+  }
+
+  map<string, BenchResult> results;
+  int regressions = 0, failures = 0;
+  printf("%-10s %-32s %9s %9s %9s %10s\n", "scene", "", "wall s", "render s", "Mrays/s", "peak KB");
+  for(int s = 0; s < NUM_SCENES; ++s) {
+    const BenchScene& scene = SCENES[s];
+    if(!only.empty() && only != scene.name) continue;
+
+    {
+      ofstream out((dir + "/" + scene.name + ".ray").c_str());
+      scene.write(out);
+    }
+
+    BenchResult best;
+    bool ok = true;
+    for(int k = 0; k < repeat && ok; ++k) {
+      BenchResult r;
+      ok = runScene(scene, rayPath, dir, threads, r);
+      if(ok && (k == 0 || r.seconds < best.seconds)) {
+        long peak = max(best.peakKB, r.peakKB);
+        best = r;
+        best.peakKB = peak;
+      }
+    }
+    if(!ok) {
+      ++failures;
+      continue;
+    }
+    results[scene.name] = best;
+
+    printf("%-10s %-32s %9.3f %9.3f %9.3f %10ld\n", scene.name, scene.description,
+           best.seconds, best.renderSeconds, best.mraysPerSecond, best.peakKB);
+
+    map<string, BenchResult>::const_iterator b = baseline.find(scene.name);
+    if(save || b == baseline.end()) continue;
+    const BenchResult& base = b->second;
+    double dt = change(best.seconds, base.seconds);
+    double dr = change(best.mraysPerSecond, base.mraysPerSecond);
+    double dm = change(best.peakKB, base.peakKB);
+    bool slower = dt > tolerance || -dr > tolerance;
+    bool bigger = dm > tolerance;
+    printf("%-10s %-32s %+8.1f%% %9s %+8.1f%% %+9.1f%%%s\n", "", "vs baseline", dt, "", dr, dm,
+           slower || bigger ? "  REGRESSION" : "");
+    if(best.rays != base.rays) {
+      printf("%-10s %-32s %lld rays, baseline %lld\n", "", "ray count changed", best.rays, base.rays);
+    }
+    if(slower || bigger) ++regressions;
+  }
+
+  if(save) {
+    // scenes left out with -only keep their old baseline
+    for(map<string, BenchResult>::const_iterator i = results.begin(); i != results.end(); ++i) {
+      baseline[i->first] = i->second;
+    }
+    if(!writeBaseline(baselineName, baseline)) {
+      cerr << "Unable to write baseline '" << baselineName << "'" << endl;
+      return 1;
+    }
+    cout << "baseline saved to " << baselineName << endl;
+  } else if(haveBaseline) {
+    cout << regressions << " regression(s) beyond " << tolerance << "% tolerance" << endl;
+  }
+  return regressions || failures ? 1 : 0;
+}
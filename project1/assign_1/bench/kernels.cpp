@@ -0,0 +1,335 @@
+//
+// kernels.cpp
+//
+// Microbenchmarks for the ray/object intersection kernels, behind
+// "make microbench".  Each kernel is run over the same randomized set of
+// rays, fired from a sphere around the object at points near it, and
+// timed in nanoseconds per ray: over the whole set, and separately over
+// the rays that hit and those that miss, since the two usually take
+// different paths through the code.
+//
+// These are the numbers to look at for a change to one kernel's math,
+// vectorization or data layout; a full render mixes in too much else.
+//
+// A second table times the batched vecmath kernels of
+// src/vecmath/simd.h against the vec.h operators they stand in for, in
+// nanoseconds per vector over arrays of -vectors of them, and checks
+// that the two give identical results.
+//
+// usage: kernels [options]
+//   -n <#>         rays per set (default 65536)
+//   -spread <#>    half-size of the box the rays aim into; the objects
+//                  fill [-0.5,0.5]^3 or so, so this sets the hit ratio
+//                  (default 0.8)
+//   -time <s>      minimum time per measurement (default 0.1)
+//   -seed <#>      random seed (default 1)
+//   -only <name>   run just the kernels whose name contains this
+//   -vectors <#>   vectors per array for the vecmath kernels (default 4096)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../src/ui/TraceUI.h"
+#include "../src/RayTracer.h"
+#include "../src/scene/scene.h"
+#include "../src/SceneObjects/Box.h"
+#include "../src/SceneObjects/Cone.h"
+#include "../src/SceneObjects/Cylinder.h"
+#include "../src/SceneObjects/Sphere.h"
+#include "../src/SceneObjects/Square.h"
+#include "../src/SceneObjects/trimesh.h"
+#include "../src/SceneObjects/tripacket.h"
+#include "../src/vecmath/simd.h"
+
+using namespace std;
+
+// main.cpp is not linked in; the scene code expects these.
+RayTracer* theRayTracer;
+TraceUI* traceUI;
+
+class BenchUI : public TraceUI {
+public:
+  int run() { return 0; }
+  void alert(const string& msg) { fprintf(stderr, "%s\n", msg.c_str()); }
+};
+
+// Deterministic on every platform, unlike rand() or <random>'s
+// distributions.
+class Random {
+public:
+  explicit Random(unsigned int seed) : state(seed) {}
+  double next() {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) * (1.0 / 16777216.0);
+  }
+  double range(double lo, double hi) { return lo + (hi - lo) * next(); }
+private:
+  unsigned int state;
+};
+
+struct Options {
+  Options() : rays(65536), vectors(4096), spread(0.8), minSeconds(0.1), seed(1) {}
+  int rays;
+  int vectors;
+  double spread;
+  double minSeconds;
+  unsigned int seed;
+  string only;
+};
+
+// Origins uniformly on a sphere of radius 3, aimed at random points in
+// [-spread,spread]^3.
+static vector<ray> makeRays(const Options& opt) {
+  Random rnd(opt.seed);
+  vector<ray> rays;
+  rays.reserve(opt.rays);
+  while((int)rays.size() < opt.rays) {
+    Vec3d p(rnd.range(-1, 1), rnd.range(-1, 1), rnd.range(-1, 1));
+    double len = p.length();
+    if(len > 1 || len < 1.0e-3) continue;
+    p *= 3 / len;
+    Vec3d target(rnd.range(-opt.spread, opt.spread), rnd.range(-opt.spread, opt.spread),
+                 rnd.range(-opt.spread, opt.spread));
+    Vec3d d = target - p;
+    d.normalize();
+    rays.push_back(ray(p, d, ray::VISIBILITY));
+  }
+  return rays;
+}
+
+static double now() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Keeps the compiler from dropping the kernel calls.
+static volatile double sink;
+
+// Best time over a few trials, each repeating the whole set until it has
+// run for at least minSeconds; nanoseconds per ray.
+template <typename Kernel>
+static double timeRays(Kernel& kernel, vector<ray>& rays, double minSeconds) {
+  if(rays.empty()) return 0;
+  double best = 1.0e30;
+  for(int trial = 0; trial < 5; ++trial) {
+    long long count = 0;
+    double sum = 0, start = now(), elapsed;
+    do {
+      for(size_t k = 0; k < rays.size(); ++k) sum += kernel(rays[k]);
+      count += rays.size();
+      elapsed = now() - start;
+    } while(elapsed < minSeconds);
+    sink = sum;
+    best = min(best, elapsed * 1.0e9 / count);
+  }
+  return best;
+}
+
+// kernel(r) returns the hit distance, or 0 for a miss.
+template <typename Kernel>
+static void bench(const char* name, Kernel kernel, const vector<ray>& rays, const Options& opt) {
+  if(!opt.only.empty() && string(name).find(opt.only) == string::npos) return;
+
+  vector<ray> all(rays), hits, misses;
+  for(size_t k = 0; k < all.size(); ++k) {
+    (kernel(all[k]) != 0 ? hits : misses).push_back(all[k]);
+  }
+
+  double tAll = timeRays(kernel, all, opt.minSeconds);
+  double tHit = timeRays(kernel, hits, opt.minSeconds);
+  double tMiss = timeRays(kernel, misses, opt.minSeconds);
+  printf("%-30s %8.2f %7.1f%% %8.2f %8.2f\n", name, tAll,
+         100.0 * hits.size() / all.size(), tHit, tMiss);
+}
+
+// Calls obj.intersectLocal on a fresh isect, the way Geometry::intersect
+// does.
+template <typename Obj>
+struct LocalKernel {
+  explicit LocalKernel(const Obj& o) : obj(o) {}
+  double operator()(ray& r) const {
+    isect i;
+    return obj.intersectLocal(r, i) ? i.t : 0.0;
+  }
+  const Obj& obj;
+};
+
+template <typename Obj>
+static LocalKernel<Obj> local(const Obj& obj) { return LocalKernel<Obj>(obj); }
+
+struct BoxKernel {
+  explicit BoxKernel(const BoundingBox& b) : box(b) {}
+  double operator()(ray& r) const {
+    double tMin, tMax;
+    return box.intersect(SlabRay(r), tMin, tMax) ? tMax : 0.0;
+  }
+  const BoundingBox& box;
+};
+
+// One packed test of TRI_PACKET_WIDTH triangles: the first lane is the
+// same triangle as the TrimeshFace kernel, the rest are spread over the
+// unit cube.
+struct PacketKernel {
+  PacketKernel(const TriPacket& p) : packet(p) {}
+  double operator()(ray& r) const {
+    TriPacketRay pr(r.getPosition(), r.getDirection(), 1.0);
+    float beta[TRI_PACKET_WIDTH], gamma[TRI_PACKET_WIDTH];
+    return packet.hits(pr, 1.0e30f, beta, gamma) & 1;
+  }
+  const TriPacket& packet;
+};
+
+// Best time over a few trials of kernel(), which transforms a whole
+// array of count vectors; nanoseconds per vector.
+template <typename Kernel>
+static double timeVectors(Kernel kernel, int count, double minSeconds) {
+  double best = 1.0e30;
+  for(int trial = 0; trial < 5; ++trial) {
+    long long done = 0;
+    double start = now(), elapsed;
+    do {
+      kernel();
+      done += count;
+      elapsed = now() - start;
+    } while(elapsed < minSeconds);
+    best = min(best, elapsed * 1.0e9 / done);
+  }
+  return best;
+}
+
+// Times a vec.h loop and its simd.h replacement, each writing its own
+// output array, and compares the arrays bit for bit.
+template <typename Plain, typename Batched, typename V>
+static void benchVectors(const char* name, Plain plain, Batched batched,
+                         const vector<V>& a, const vector<V>& b, const Options& opt) {
+  if(!opt.only.empty() && string(name).find(opt.only) == string::npos) return;
+  double tPlain = timeVectors(plain, a.size(), opt.minSeconds);
+  double tBatched = timeVectors(batched, b.size(), opt.minSeconds);
+  bool same = a.size() == b.size() && memcmp(&a[0], &b[0], a.size() * sizeof(V)) == 0;
+  printf("%-30s %8.2f %8.2f %7.2fx %s\n", name, tPlain, tBatched, tPlain / tBatched,
+         same ? "same" : "DIFFERENT");
+}
+
+template <typename T>
+static void benchVecmath(const char* type, const Options& opt) {
+  Random rnd(opt.seed + 2);
+  Mat4<T> m4;
+  for(int k = 0; k < 16; ++k) m4.n[k] = T(rnd.range(-2, 2));
+  Mat3<T> m3 = m4.upper33();
+  Vec3<T> t(m4.n[3], m4.n[7], m4.n[11]);
+  int n = opt.vectors;
+  vector<Vec3<T> > in3(n), a3(n), b3(n);
+  vector<Vec4<T> > in4(n), a4(n), b4(n);
+  for(int k = 0; k < n; ++k) {
+    in3[k] = Vec3<T>(T(rnd.range(-5, 5)), T(rnd.range(-5, 5)), T(rnd.range(-5, 5)));
+    in4[k] = Vec4<T>(in3[k][0], in3[k][1], in3[k][2], T(rnd.range(-1, 1)));
+  }
+
+  string name = string("Mat4") + type + " * Vec4" + type;
+  benchVectors(name.c_str(),
+               [&]() { for(int k = 0; k < n; ++k) a4[k] = m4 * in4[k]; },
+               [&]() { mulArray(m4, &in4[0], &b4[0], n); }, a4, b4, opt);
+  name = string("Mat3") + type + " * Vec3" + type;
+  benchVectors(name.c_str(),
+               [&]() { for(int k = 0; k < n; ++k) a3[k] = m3 * in3[k]; },
+               [&]() { transformVectors(m3, &in3[0], &b3[0], n); }, a3, b3, opt);
+  name = string("Mat3") + type + " * Vec3" + type + " + t";
+  benchVectors(name.c_str(),
+               [&]() { for(int k = 0; k < n; ++k) a3[k] = m3 * in3[k] + t; },
+               [&]() { transformPoints(m3, t, &in3[0], &b3[0], n); }, a3, b3, opt);
+
+  // a cross product and a dot, as in shading
+  typedef typename Simd4<T>::type X;
+  name = string("Vec3") + type + " ^ and *";
+  benchVectors(name.c_str(),
+               [&]() {
+                 for(int k = 1; k < n; ++k) {
+                   Vec3<T> c = in3[k - 1] ^ in3[k];
+                   a3[k] = c * (c * in3[k]);
+                 }
+               },
+               [&]() {
+                 for(int k = 1; k < n; ++k) {
+                   X c = X::load3(in3[k - 1].n) ^ X::load3(in3[k].n);
+                   (c * (c * X::load3(in3[k].n))).store3(b3[k].n);
+                 }
+               }, a3, b3, opt);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-n rays] [-spread #] [-time seconds] [-seed #] [-only name] [-vectors #]\n", prog);
+}
+
+int main(int argc, char** argv) {
+  Options opt;
+  for(int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if(arg == "-n" && hasValue) opt.rays = max(1, atoi(argv[++i]));
+    else if(arg == "-spread" && hasValue) opt.spread = atof(argv[++i]);
+    else if(arg == "-time" && hasValue) opt.minSeconds = atof(argv[++i]);
+    else if(arg == "-seed" && hasValue) opt.seed = atoi(argv[++i]);
+    else if(arg == "-only" && hasValue) opt.only = argv[++i];
+    else if(arg == "-vectors" && hasValue) opt.vectors = max(2, atoi(argv[++i]));
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  traceUI = new BenchUI;
+  Scene* scene = NULL;   // the kernels never look at their scene
+  vector<ray> rays = makeRays(opt);
+
+  Sphere sphere(scene, new Material);
+  Box box(scene, new Material);
+  Cone cone(scene, new Material, 1.0, 0.5, 0.1, true);
+  Cylinder cylinder(scene, new Material);
+  Square square(scene, new Material);
+
+  TransformRoot root;
+  Trimesh mesh(scene, new Material, &root);
+  Vec3d tri[3] = { Vec3d(-0.5, -0.4, 0.1), Vec3d(0.5, -0.5, -0.1), Vec3d(0.0, 0.5, 0.0) };
+  for(int k = 0; k < 3; ++k) mesh.addVertex(tri[k]);
+  mesh.addFace(0, 1, 2);
+  const TrimeshFace& face = *mesh.faces[0];
+
+  TriPacket packet;
+  Vec3f ftri[3];
+  for(int k = 0; k < 3; ++k) ftri[k] = Vec3f(float(tri[k][0]), float(tri[k][1]), float(tri[k][2]));
+  packet.set(0, 0, ftri[0], ftri[1], ftri[2]);
+  Random rnd(opt.seed + 1);
+  for(int l = 1; l < TRI_PACKET_WIDTH; ++l) {
+    Vec3f v[3];
+    for(int k = 0; k < 3; ++k)
+      v[k] = Vec3f(float(rnd.range(-0.5, 0.5)), float(rnd.range(-0.5, 0.5)), float(rnd.range(-0.5, 0.5)));
+    packet.set(l, l, v[0], v[1], v[2]);
+  }
+
+  BoundingBox bounds(Vec3d(-0.5, -0.5, -0.5), Vec3d(0.5, 0.5, 0.5));
+
+  printf("%d rays aimed into [-%g,%g]^3, %d-wide triangle packets\n",
+         opt.rays, opt.spread, opt.spread, TRI_PACKET_WIDTH);
+  printf("%-30s %8s %8s %8s %8s\n", "kernel", "ns/ray", "hits", "ns/hit", "ns/miss");
+  bench("Sphere::intersectLocal", local(sphere), rays, opt);
+  bench("Box::intersectLocal", local(box), rays, opt);
+  bench("Cone::intersectLocal", local(cone), rays, opt);
+  bench("Cylinder::intersectLocal", local(cylinder), rays, opt);
+  bench("Square::intersectLocal", local(square), rays, opt);
+  bench("TrimeshFace::intersectLocal", local(face), rays, opt);
+  bench("TriPacket::hits", PacketKernel(packet), rays, opt);
+  bench("BoundingBox::intersect", BoxKernel(bounds), rays, opt);
+
+  printf("\n%d vectors per array\n", opt.vectors);
+  printf("%-30s %8s %8s %8s\n", "vecmath kernel", "vec.h", "simd.h", "speedup");
+  benchVecmath<float>("f", opt);
+  benchVecmath<double>("d", opt);
+  return 0;
+}
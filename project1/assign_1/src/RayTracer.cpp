@@ -6,6 +6,8 @@
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/raypacket.h"
+#include "scene/renderstats.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
@@ -13,6 +15,7 @@
 #include "ui/TraceUI.h"
 #include <cmath>
 #include <algorithm>
+#include <vector>
 
 extern TraceUI* traceUI;
 
@@ -30,6 +33,7 @@ bool debugMode = false;
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
+// The colour is linear and unclamped; toneMap() makes it displayable.
 
 Vec3d RayTracer::trace(double x, double y)
 {
@@ -37,9 +41,18 @@ Vec3d RayTracer::trace(double x, double y)
   if (TraceUI::m_debug) scene->intersectCache.clear();
   ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
   scene->getCamera().rayThrough(x,y,r);
-  Vec3d ret = traceRay(r, traceUI->getDepth());
-  ret.clamp();
-  return ret;
+  return traceRay(r, traceUI->getDepth());
+}
+
+// The 8-bit colour of a linear one: scaled by the exposure, clamped and
+// quantized.
+void RayTracer::toneMap(const Vec3d& linear, unsigned char* rgb) const
+{
+	Vec3d col = linear * exposure.load(std::memory_order_relaxed);
+	col.clamp();
+	rgb[0] = (int)( 255.0 * col[0]);
+	rgb[1] = (int)( 255.0 * col[1]);
+	rgb[2] = (int)( 255.0 * col[2]);
 }
 
 Vec3d RayTracer::tracePixel(int i, int j)
@@ -52,8 +65,12 @@ Vec3d RayTracer::tracePixel(int i, int j)
 	double y = double(j)/double(buffer_height);
 
 	int aaSize = traceUI->getAASize();
+	int samples = 1;
 	//anti-alias
-	if(aaSize > 1) {
+	if(aaSize > 1 && traceUI->adaptiveAA()) {
+		adaptiveBlock(i, j, i + 1, j + 1, NULL, &col);
+		return col;
+	} else if(aaSize > 1) {
 		//find new increment
 		double xIncr = 1.0 / (double(buffer_width) * aaSize);
 		double yIncr = 1.0 / (double(buffer_height) * aaSize);
@@ -64,23 +81,393 @@ Vec3d RayTracer::tracePixel(int i, int j)
 			}
 		}
 		col /= (aaSize * aaSize);
+		samples = aaSize * aaSize;
 
 	} else col = trace(x, y);
 
+	setPixel(i, j, col, samples);
+	return col;
+}
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+// Stores the mean col of pixel (i,j)'s samples.
+void RayTracer::setPixel(int i, int j, const Vec3d& col, int samples)
+{
+	int p = i + j * buffer_width;
+	for (int c = 0; c < 3; ++c) accum[p * 3 + c] = float(col[c] * samples);
+	sampleCount[p] = samples;
+	toneMap(col, buffer + p * 3);
+}
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
-	return col;
+// tracePixel() for the pixels [i0,i1) x [j0,j1), with the camera rays
+// traced in packets of packetSize x packetSize.  A packet takes the
+// samples of neighbouring pixels, or of one pixel when anti-aliasing,
+// and each pixel adds up its samples in the same order as tracePixel(),
+// so the image is the same.  Blocks of more than RAY_PACKET_MAX pixels
+// are traced 4x4 at a time.
+void RayTracer::tracePixelBlock(int i0, int j0, int i1, int j1, int packetSize)
+{
+	if( ! sceneLoaded() ) return;
+
+	int aaSize = traceUI->getAASize();
+	if (aaSize > 1 && traceUI->adaptiveAA()) {
+		adaptiveBlock(i0, j0, i1, j1);
+		return;
+	}
+	// sums[] has a slot per pixel
+	static_assert(4 * 4 <= RAY_PACKET_MAX, "a 4x4 block must fit a packet");
+	if ((i1 - i0) * (j1 - j0) > RAY_PACKET_MAX) {
+		for (int j = j0; j < j1; j += 4)
+			for (int i = i0; i < i1; i += 4)
+				tracePixelBlock(i, j, min(i + 4, i1), min(j + 4, j1), packetSize);
+		return;
+	}
+	int packetRays = min(packetSize * packetSize, RAY_PACKET_MAX);
+	double xIncr = 1.0 / (double(buffer_width) * aaSize);
+	double yIncr = 1.0 / (double(buffer_height) * aaSize);
+
+	Vec3d sums[RAY_PACKET_MAX];
+	double xs[RAY_PACKET_MAX], ys[RAY_PACKET_MAX];
+	int owner[RAY_PACKET_MAX];
+	Vec3d cols[RAY_PACKET_MAX];
+	int n = 0;
+	auto flush = [&]() {
+		tracePacket(xs, ys, n, cols);
+		for (int k = 0; k < n; ++k) sums[owner[k]] += cols[k];
+		n = 0;
+	};
+
+	int w = i1 - i0;
+	for (int j = j0; j < j1; ++j) {
+		for (int i = i0; i < i1; ++i) {
+			double x = double(i)/double(buffer_width);
+			double y = double(j)/double(buffer_height);
+			for (int xOffset = 0; xOffset < aaSize; ++xOffset) {
+				for (int yOffset = 0; yOffset < aaSize; ++yOffset) {
+					xs[n] = x + xOffset * xIncr;
+					ys[n] = y + yOffset * yIncr;
+					owner[n] = (i - i0) + (j - j0) * w;
+					if (++n == packetRays) flush();
+				}
+			}
+		}
+	}
+	if (n > 0) flush();
+
+	for (int j = j0; j < j1; ++j) {
+		for (int i = i0; i < i1; ++i) {
+			Vec3d col = sums[(i - i0) + (j - j0) * w];
+			if (aaSize > 1) col /= (aaSize * aaSize);
+			setPixel(i, j, col, aaSize * aaSize);
+		}
+	}
+}
+
+// Lights whose shadow rays tracePacket() traces as packets; scenes with
+// more are traced ray by ray.
+static const int PACKET_MAX_LIGHTS = 16;
+
+// trace() for n <= RAY_PACKET_MAX camera rays at once.  The camera rays
+// find their hits as a packet, and so do the shadow rays from those hits
+// to each light; shading and the reflected and refracted rays then go
+// ray by ray through traceRay().
+void RayTracer::tracePacket(const double* x, const double* y, int n, Vec3d* cols)
+{
+	int numLights = scene->endLights() - scene->beginLights();
+	if (TraceUI::m_debug || numLights > PACKET_MAX_LIGHTS) {
+		for (int k = 0; k < n; ++k) cols[k] = trace(x[k], y[k]);
+		return;
+	}
+
+	RayPacket pk;
+	for (int k = 0; k < n; ++k) {
+		ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+		scene->getCamera().rayThrough(x[k], y[k], r);
+		pk.add(r);
+	}
+	renderCounters.rays[ray::VISIBILITY] += n;
+	scene->intersect(pk);
+
+	Vec3d shadows[RAY_PACKET_MAX * PACKET_MAX_LIGHTS];
+	int l = 0;
+	for (Scene::cliter light = scene->beginLights(); light != scene->endLights(); ++light, ++l) {
+		Vec3d points[RAY_PACKET_MAX], atten[RAY_PACKET_MAX];
+		int from[RAY_PACKET_MAX];
+		int m = 0;
+		for (int k = 0; k < n; ++k) {
+			if (!(pk.hit & (1 << k))) continue;
+			from[m] = k;
+			points[m++] = pk.rays[k].at(pk.hits[k].t);
+		}
+		if (m == 0) break;
+		shadowPacket(*light, points, m, atten);
+		for (int s = 0; s < m; ++s) shadows[from[s] * numLights + l] = atten[s];
+	}
+
+	int depth = traceUI->getDepth();
+	for (int k = 0; k < n; ++k) {
+		if (pk.hit & (1 << k))
+			cols[k] = shade(pk.rays[k], pk.hits[k], depth, numLights ? &shadows[k * numLights] : NULL);
+		else cols[k] = background(pk.rays[k]);
+	}
+}
+
+// light->shadowAttenuation() at each of n <= RAY_PACKET_MAX points, with
+// the shadow rays traced as a packet.
+void RayTracer::shadowPacket(const Light* light, const Vec3d* points, int n, Vec3d* atten)
+{
+	RayPacket shadow;
+	for (int k = 0; k < n; ++k)
+		shadow.add(ray(points[k], light->getDirection(points[k]), ray::SHADOW),
+		           light->shadowDistance(points[k]));
+	scene->occluded(shadow);
+	for (int k = 0; k < n; ++k) {
+		if (shadow.occluded & (1 << k)) atten[k] = Vec3d(0, 0, 0);
+		else if (!(shadow.translucent & (1 << k))) atten[k] = Vec3d(1, 1, 1);
+		else atten[k] = light->translucentAttenuation(scene, points[k]);
+	}
+}
+
+// A square of a pixel's anti-aliasing grid, by the grid points at its
+// corners, and how much those differ.
+struct AAQuad {
+	double contrast;
+	int pixel;	// in the block, row by row
+	int a0, b0, a1, b1;
+
+	bool operator<(const AAQuad& q) const { return contrast < q.contrast; }
+};
+
+// adaptiveBlock()'s working space, kept from block to block so a render
+// thread allocates it once.  Nothing in it outlives a block.
+struct AAScratch {
+	std::vector<Vec3d> samples;	// each pixel's grid, a * aaSize + b
+	std::vector<char> state;	// AA_UNKNOWN, AA_TRACED or AA_FILLED
+	std::vector<int> traced;	// per pixel
+	std::vector<AAQuad> heap;	// quads to refine, most contrast first
+	std::vector<AAQuad> leaves;	// quads that stay whole
+};
+enum { AA_UNKNOWN, AA_TRACED, AA_FILLED };
+
+static thread_local AAScratch aaScratch;
+
+static inline double displayed(double v)
+{
+	return v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+}
+
+// The largest difference between two of q's corners in any channel.
+static double quadContrast(const Vec3d* grid, int aaSize, const AAQuad& q)
+{
+	const Vec3d* corners[4] = { &grid[q.a0 * aaSize + q.b0], &grid[q.a1 * aaSize + q.b0],
+	                            &grid[q.a0 * aaSize + q.b1], &grid[q.a1 * aaSize + q.b1] };
+	double contrast = 0.0;
+	for (int ch = 0; ch < 3; ++ch) {
+		double lo = displayed((*corners[0])[ch]), hi = lo;
+		for (int k = 1; k < 4; ++k) {
+			lo = min(lo, displayed((*corners[k])[ch]));
+			hi = max(hi, displayed((*corners[k])[ch]));
+		}
+		contrast = max(contrast, hi - lo);
+	}
+	return contrast;
+}
+
+// Adaptive supersampling of the pixels [i0,i1) x [j0,j1).  A pixel's
+// samples are the points of its regular aaSize x aaSize grid, but only
+// some of them are traced: first the grid's four corners, then, in each
+// quad whose corners differ by more than the contrast threshold, the
+// points that halve its sides, and so on down to neighbouring grid
+// points.  The points left are interpolated from the corners of the quad
+// they lie in.  A pixel refined all the way traces its whole grid and
+// comes out exactly as in tracePixel(); none ever traces more.
+//
+// The sample cap is the render's, as an average per pixel: each block
+// gets its pixels' share and spends it on its quads of most contrast
+// first.  RenderJob's blocks are its tiles, so where the samples go
+// depends on the image alone, not on which thread renders what.
+//
+// Contrast is judged on the samples clamped to the displayable range,
+// which is what the threshold means to the eye; the pixels' colours are
+// the plain linear averages.  cols, if given, receives them row by row.
+//
+// Once stop is set, a block still taking its first samples is dropped,
+// its pixels untouched, and one being refined stops refining and is
+// finished with the samples it has.
+void RayTracer::adaptiveBlock(int i0, int j0, int i1, int j1, const std::atomic<bool>* stop,
+                              Vec3d* cols)
+{
+	if( ! sceneLoaded() ) return;
+
+	int aaSize = traceUI->getAASize();
+	double threshold = traceUI->getAAThreshold();
+	double xIncr = 1.0 / (double(buffer_width) * aaSize);
+	double yIncr = 1.0 / (double(buffer_height) * aaSize);
+	int w = i1 - i0, pixels = w * (j1 - j0), grid = aaSize * aaSize;
+	long budget = long(max(traceUI->getAAMaxSamples(), 4)) * pixels;
+	long spent = 0;
+
+	AAScratch& s = aaScratch;
+	s.samples.resize(pixels * grid);
+	s.state.assign(pixels * grid, AA_UNKNOWN);
+	s.traced.assign(pixels, 0);
+	s.heap.clear();
+	s.leaves.clear();
+
+	auto sample = [&](int pixel, int a, int b) {
+		int g = pixel * grid + a * aaSize + b;
+		if (s.state[g] == AA_TRACED) return;
+		double x = double(i0 + pixel % w)/double(buffer_width);
+		double y = double(j0 + pixel / w)/double(buffer_height);
+		s.samples[g] = trace(x + a * xIncr, y + b * yIncr);
+		s.state[g] = AA_TRACED;
+		++s.traced[pixel];
+		++spent;
+	};
+	// to be refined further, or kept whole
+	auto place = [&](const AAQuad& q) {
+		bool splits = q.a1 - q.a0 > 1 || q.b1 - q.b0 > 1;
+		if (splits && q.contrast > threshold) {
+			s.heap.push_back(q);
+			push_heap(s.heap.begin(), s.heap.end());
+		} else s.leaves.push_back(q);
+	};
+
+	for (int pixel = 0; pixel < pixels; ++pixel) {
+		if (pixel % w == 0 && stop && *stop) return;
+		AAQuad q = { 0.0, pixel, 0, 0, aaSize - 1, aaSize - 1 };
+		sample(pixel, q.a0, q.b0);
+		sample(pixel, q.a1, q.b0);
+		sample(pixel, q.a0, q.b1);
+		sample(pixel, q.a1, q.b1);
+		q.contrast = quadContrast(&s.samples[pixel * grid], aaSize, q);
+		place(q);
+	}
+
+	while (!s.heap.empty() && !(stop && *stop)) {
+		pop_heap(s.heap.begin(), s.heap.end());
+		AAQuad q = s.heap.back();
+		s.heap.pop_back();
+
+		// the children's corners; a side one cell long is not split
+		int na = q.a1 - q.a0 > 1 ? 2 : 1, nb = q.b1 - q.b0 > 1 ? 2 : 1;
+		int as[3] = { q.a0, na == 2 ? (q.a0 + q.a1) / 2 : q.a1, q.a1 };
+		int bs[3] = { q.b0, nb == 2 ? (q.b0 + q.b1) / 2 : q.b1, q.b1 };
+		int cost = 0;
+		for (int u = 0; u <= na; ++u)
+			for (int v = 0; v <= nb; ++v)
+				cost += s.state[q.pixel * grid + as[u] * aaSize + bs[v]] != AA_TRACED;
+		if (spent + cost > budget) {
+			s.leaves.push_back(q);
+			continue;
+		}
+		for (int u = 0; u <= na; ++u)
+			for (int v = 0; v <= nb; ++v)
+				sample(q.pixel, as[u], bs[v]);
+		for (int u = 0; u < na; ++u) {
+			for (int v = 0; v < nb; ++v) {
+				AAQuad c = { 0.0, q.pixel, as[u], bs[v], as[u + 1], bs[v + 1] };
+				c.contrast = quadContrast(&s.samples[q.pixel * grid], aaSize, c);
+				place(c);
+			}
+		}
+	}
+
+	s.leaves.insert(s.leaves.end(), s.heap.begin(), s.heap.end());
+
+	// the points not traced, bilinearly between their quad's corners
+	for (size_t k = 0; k < s.leaves.size(); ++k) {
+		const AAQuad& q = s.leaves[k];
+		Vec3d* g = &s.samples[q.pixel * grid];
+		char* state = &s.state[q.pixel * grid];
+		Vec3d c00 = g[q.a0 * aaSize + q.b0], c10 = g[q.a1 * aaSize + q.b0];
+		Vec3d c01 = g[q.a0 * aaSize + q.b1], c11 = g[q.a1 * aaSize + q.b1];
+		for (int a = q.a0; a <= q.a1; ++a) {
+			double u = double(a - q.a0) / (q.a1 - q.a0);
+			for (int b = q.b0; b <= q.b1; ++b) {
+				if (state[a * aaSize + b] != AA_UNKNOWN) continue;
+				double v = double(b - q.b0) / (q.b1 - q.b0);
+				g[a * aaSize + b] = (c00 * (1 - u) + c10 * u) * (1 - v) + (c01 * (1 - u) + c11 * u) * v;
+				state[a * aaSize + b] = AA_FILLED;
+			}
+		}
+	}
+
+	// each pixel adds up its samples in tracePixel()'s order
+	for (int pixel = 0; pixel < pixels; ++pixel) {
+		Vec3d col(0, 0, 0);
+		for (int k = 0; k < grid; ++k) col += s.samples[pixel * grid + k];
+		col /= grid;
+		setPixel(i0 + pixel % w, j0 + pixel / w, col, s.traced[pixel]);
+		if (cols) cols[pixel] = col;
+	}
+}
+
+// Point k of the first two dimensions of the Sobol' sequence, a (0,2)
+// sequence: every run of 4^m points starting at a multiple of 4^m puts
+// one point in each cell of a 2^m x 2^m grid.
+static void sobol02(unsigned int k, double& u, double& v)
+{
+	unsigned int x = 0, y = 0;
+	for (unsigned int bit = 1u << 31, c = 1u << 31; k; k >>= 1, bit >>= 1, c ^= c >> 1) {
+		if (k & 1) {
+			x |= bit;
+			y ^= c;
+		}
+	}
+	u = x * (1.0 / 4294967296.0);
+	v = y * (1.0 / 4294967296.0);
+}
+
+// Where sample k of a progressive render falls in its pixel, as a
+// fraction of the pixel.  The first aaSize^2 samples are exactly the
+// regular anti-aliasing grid, so a finished progressive render matches
+// the one-shot one; later samples, for renders that keep going, continue
+// the Sobol' sequence.
+void RayTracer::sampleOffset(int k, double& dx, double& dy) const
+{
+	if (k < int(sampleOrder.size())) {
+		dx = sampleOrder[k].first;
+		dy = sampleOrder[k].second;
+	} else sobol02(k, dx, dy);
 }
 
+// Adds sample k of pixel (i,j) to the accumulation buffer and shows the
+// pixel's running average.  In the coarse preview passes, block > 1, the
+// sample also stands in for the pixels of its block x block square that
+// have no sample of their own yet.
+void RayTracer::progressiveSample(int i, int j, int k, int block)
+{
+	if( ! sceneLoaded() ) return;
+
+	double dx, dy;
+	sampleOffset(k, dx, dy);
+	Vec3d col = trace((i + dx) / double(buffer_width), (j + dy) / double(buffer_height));
+
+	int p = i + j * buffer_width;
+	float* sum = accum + p * 3;
+	for (int c = 0; c < 3; ++c) sum[c] += float(col[c]);
+	int n = ++sampleCount[p];
+
+	unsigned char rgb[3];
+	toneMap(Vec3d(sum[0], sum[1], sum[2]) / n, rgb);
+
+	int i1 = min(i + block, buffer_width), j1 = min(j + block, buffer_height);
+	for (int jj = j; jj < j1; ++jj) {
+		for (int ii = i; ii < i1; ++ii) {
+			int q = ii + jj * buffer_width;
+			if (q != p && sampleCount[q] > 0) continue;
+			unsigned char *pixel = buffer + q * 3;
+			pixel[0] = rgb[0];
+			pixel[1] = rgb[1];
+			pixel[2] = rgb[2];
+		}
+	}
+}
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
 
-bool TIR(Vec3d& N, Vec3d d, double index) {
+bool TIR(const Vec3d& N, Vec3d d, double index) {
 	double angle = N * d;
 	if(angle > 0.0) {
 		if(1.0 - (index * index * (1.0 - angle * angle)) < 0.0) {
@@ -93,20 +480,45 @@ bool TIR(Vec3d& N, Vec3d d, double index) {
 Vec3d RayTracer::traceRay(ray& r, int depth)
 {
 	isect i;
-	Vec3d colorC;
-	if(scene->intersect(r, i)) {
-		const Material& m = i.getMaterial();
-		colorC = m.shade(scene, r, i);
-		if(depth < 1) {
-			return colorC;
-		}
+	++renderCounters.rays[r.type()];
+	if(scene->intersect(r, i)) return shade(r, i, depth);
+	else return background(r);
+}
+
+// The colour of hit i on ray r: shaded, plus what it reflects and
+// transmits.  shadows are as for Material::shade().
+Vec3d RayTracer::shade(ray& r, const isect& i, int depth, const Vec3d* shadows)
+{
+	MaterialScratch scratch;
+	const Material& m = i.getMaterial(scratch);
+	Vec3d colorC = m.shade(scene, r, i, shadows);
+	if(depth < 1) {
+		return colorC;
+	}
+	ray reflected, refracted;
+	int spawned = secondaryRays(r, i, m, reflected, refracted);
+	if(spawned & SPAWN_REFLECTION)
+		colorC += m.kr(i) % traceRay(reflected, depth - 1);
+	if(spawned & SPAWN_REFRACTION)
+		colorC += m.kt(i) % traceRay(refracted, depth - 1);
+	return colorC;
+}
+
+// The rays hit i on ray r spawns, as a mask of SPAWN_REFLECTION and
+// SPAWN_REFRACTION; each one spawned is set in reflected or refracted.
+// m is the material at i, as the caller has it.
+int RayTracer::secondaryRays(const ray& r, const isect& i, const Material& m,
+                             ray& reflected, ray& refracted)
+{
+	int spawned = 0;
+	{
 		Vec3d iC = i.N * (-r.getDirection() * i.N);
 		Vec3d iS = iC + r.getDirection();
 		if(m.Refl()) {
 		  Vec3d R = iC + iS;
 		  R.normalize();
-		  ray newRay = ray(r.at(i.t), R, ray::REFLECTION);
-		  colorC += m.kr(i) % traceRay(newRay, depth - 1);
+		  reflected = ray(r.at(i.t), R, ray::REFLECTION);
+		  spawned |= SPAWN_REFLECTION;
 		}
 		
 		double n_i, n_t;
@@ -130,30 +542,35 @@ Vec3d RayTracer::traceRay(ray& r, int depth)
 			else tC = N * sqrt((1 - tS * tS));
 				Vec3d T = tC + tS;
 				T.normalize();
-				ray newRay = ray(r.at(i.t), T, ray::REFRACTION);
-				colorC += m.kt(i) % traceRay(newRay, depth - 1);
+				refracted = ray(r.at(i.t), T, ray::REFRACTION);
+				spawned |= SPAWN_REFRACTION;
 		}
-
-	} else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
-		if(traceUI->gotCubeMap() && traceUI->useCubeMap()) {
-			return cubemap->getColor(r);
-			//return colorC = Vec3d(0, 0, 1);
-		} else colorC = Vec3d(0, 0, 0);
 	}
-	return colorC;
+	return spawned;
+}
+
+// No intersection.  This ray travels to infinity, so we color
+// it according to the background color, which in this (simple) case
+// is just black.
+Vec3d RayTracer::background(const ray& r)
+{
+	if(traceUI->gotCubeMap() && traceUI->useCubeMap()) {
+		return cubemap->getColor(r);
+		//return colorC = Vec3d(0, 0, 1);
+	} else return Vec3d(0, 0, 0);
 }
 
 RayTracer::RayTracer()
-	: scene(0), buffer(0), buffer_width(256), buffer_height(256), m_bBufferReady(false), cubemap(NULL)
+	: buffer(0), buffer_width(256), buffer_height(256), accum(0), sampleCount(0),
+	  exposure(1.0), scene(0), cubemap(NULL), m_bBufferReady(false)
 {}
 
 RayTracer::~RayTracer()
 {
 	delete scene;
 	delete [] buffer;
+	delete [] accum;
+	delete [] sampleCount;
 	delete cubemap;
 }
 
@@ -164,6 +581,63 @@ void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 	h = buffer_height;
 }
 
+// Scales the linear colours by 2^stops before they are clamped.
+void RayTracer::setExposure(double stops)
+{
+	exposure = pow(2.0, stops);
+}
+
+// Redoes buffer from the linear framebuffer, after setExposure(), say.
+// Pixels without samples of their own are left as they are.
+void RayTracer::toneMapBuffer()
+{
+	if (!buffer) return;
+	for (int p = 0; p < buffer_width * buffer_height; ++p) {
+		if (sampleCount[p] == 0) continue;
+		const float* sum = accum + p * 3;
+		toneMap(Vec3d(sum[0], sum[1], sum[2]) / sampleCount[p], buffer + p * 3);
+	}
+}
+
+// The linear framebuffer as the mean colour of each pixel, three floats
+// per pixel in the order of buffer; pixels without samples are black.
+void RayTracer::getLinearImage(std::vector<float>& rgb) const
+{
+	int n = buffer_width * buffer_height;
+	rgb.assign(n * 3, 0.0f);
+	for (int p = 0; p < n; ++p) {
+		if (sampleCount[p] == 0) continue;
+		for (int c = 0; c < 3; ++c) rgb[p * 3 + c] = accum[p * 3 + c] / sampleCount[p];
+	}
+}
+
+// Makes a saved linear image the framebuffer, one sample per pixel, and
+// tone maps it; for re-exposing a render without tracing it again.
+void RayTracer::setLinearImage(const float* rgb, int w, int h)
+{
+	setBufferSize(w, h);
+	std::copy(rgb, rgb + w * h * 3, accum);
+	std::fill(sampleCount, sampleCount + w * h, 1);
+	toneMapBuffer();
+	m_bBufferReady = true;
+}
+
+void RayTracer::setBufferSize(int w, int h)
+{
+	if (buffer_width != w || buffer_height != h || !buffer)
+	{
+		buffer_width = w;
+		buffer_height = h;
+		bufferSize = buffer_width * buffer_height * 3;
+		delete[] buffer;
+		buffer = new unsigned char[bufferSize];
+		delete[] accum;
+		accum = new float[w * h * 3];
+		delete[] sampleCount;
+		sampleCount = new int[w * h];
+	}
+}
+
 double RayTracer::aspectRatio()
 {
 	return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
@@ -216,15 +690,29 @@ bool RayTracer::loadScene( char* fn ) {
 
 void RayTracer::traceSetup(int w, int h)
 {
-	if (buffer_width != w || buffer_height != h)
-	{
-		buffer_width = w;
-		buffer_height = h;
-		bufferSize = buffer_width * buffer_height * 3;
-		delete[] buffer;
-		buffer = new unsigned char[bufferSize];
-	}
+	// The split method can be changed between renders; rebuild to match.
+	if (sceneLoaded() && scene->kdTreeSplit() != traceUI->getKdSplit())
+		scene->buildKdTree();
+
+	setBufferSize(w, h);
+	exposure = pow(2.0, traceUI->getExposure());
 	memset(buffer, 0, w*h*3);
+	std::fill(accum, accum + w * h * 3, 0.0f);
+	std::fill(sampleCount, sampleCount + w * h, 0);
+
+	// The regular grid in the order a (0,2)-sequence visits its cells, so
+	// that the first 4, 16, ... samples of a pixel are evenly spread.
+	int aaSize = traceUI->getAASize();
+	std::vector<bool> taken(aaSize * aaSize, false);
+	sampleOrder.clear();
+	for (unsigned int k = 0; sampleOrder.size() < taken.size() && k < (1u << 20); ++k) {
+		double u, v;
+		sobol02(k, u, v);
+		int a = int(u * aaSize), b = int(v * aaSize);
+		if (taken[a + b * aaSize]) continue;
+		taken[a + b * aaSize] = true;
+		sampleOrder.push_back(std::make_pair(double(a) / aaSize, double(b) / aaSize));
+	}
 	m_bBufferReady = true;
 }
 
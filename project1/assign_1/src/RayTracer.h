@@ -6,9 +6,13 @@
 #include "scene/ray.h"
 #include "scene/cubeMap.h"
 #include <time.h>
+#include <atomic>
 #include <queue>
+#include <utility>
+#include <vector>
 
 class Scene;
+class Light;
 
 class RayTracer
 {
@@ -17,13 +21,32 @@ public:
         ~RayTracer();
 
 	Vec3d tracePixel(int i, int j);
+	void tracePixelBlock(int i0, int j0, int i1, int j1, int packetSize);
+	void setPixel(int i, int j, const Vec3d& col, int samples);
+	void adaptiveBlock(int i0, int j0, int i1, int j1, const std::atomic<bool>* stop = NULL,
+	                   Vec3d* cols = NULL);
+	void progressiveSample(int i, int j, int k, int block);
+	void sampleOffset(int k, double& dx, double& dy) const;
 	Vec3d trace(double x, double y);
 	Vec3d traceRay(ray& r, int depth);
+	void tracePacket(const double* x, const double* y, int n, Vec3d* cols);
+	void shadowPacket(const Light* light, const Vec3d* points, int n, Vec3d* atten);
+	Vec3d shade(ray& r, const isect& i, int depth, const Vec3d* shadows = NULL);
+	Vec3d background(const ray& r);
+	enum { SPAWN_REFLECTION = 1, SPAWN_REFRACTION = 2 };
+	static int secondaryRays(const ray& r, const isect& i, const Material& m,
+	                         ray& reflected, ray& refracted);
 
 	void getBuffer(unsigned char *&buf, int &w, int &h);
+	void toneMap(const Vec3d& linear, unsigned char* rgb) const;
+	void setExposure(double stops);
+	void toneMapBuffer();
+	void getLinearImage(std::vector<float>& rgb) const;
+	void setLinearImage(const float* rgb, int w, int h);
 	double aspectRatio();
 
 	void traceSetup( int w, int h );
+	void setBufferSize( int w, int h );
 
 	bool loadScene(char* fn);
 	bool sceneLoaded() { return scene != 0; }
@@ -44,6 +67,15 @@ public:
         unsigned char *buffer;
         int buffer_width, buffer_height;
         int bufferSize;
+
+        // The linear framebuffer: each pixel's samples summed as RGB, and
+        // how many there are.  buffer is its tone mapped view.
+        float *accum;
+        int *sampleCount;
+        std::atomic<double> exposure;   // linear scale applied by toneMap()
+        // sample k of a pixel is at sampleOrder[k] when k is in range:
+        // the regular aaSize x aaSize grid, stratified at every prefix
+        std::vector<std::pair<double, double> > sampleOrder;
         Scene* scene;
         CubeMap* cubemap;
 
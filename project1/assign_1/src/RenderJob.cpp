@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include "RenderJob.h"
+#include "RayTracer.h"
+#include "Wavefront.h"
+#include "ui/TraceUI.h"
+
+extern TraceUI* traceUI;
+
+RenderJob::RenderJob(RayTracer* tracer, int w, int h, int threads, int tileSize)
+	: raytracer(tracer), width(w), height(h), numThreads(threads < 1 ? 1 : threads),
+	  tiles(w, h, tileSize), stopped(false), finishedTiles(0),
+	  progressive(false), packetSize(0), wavefront(false), numPasses(1), previewPasses(0), pass(0), completedPasses(0),
+	  waiting(0), running(0)
+{}
+
+void RenderJob::setProgressive(int samples)
+{
+	progressive = true;
+	previewPasses = 3;	// blocks of 8, 4 and 2
+	numPasses = previewPasses + std::max(samples, 1);
+}
+
+void RenderJob::cancel()
+{
+	stopped = true;
+	std::lock_guard<std::mutex> lk(lock);
+	passDone.notify_all();
+}
+
+RenderJob::~RenderJob()
+{
+	cancel();
+	wait();
+}
+
+void RenderJob::start()
+{
+	startTime = endTime = std::chrono::steady_clock::now();
+	running = numThreads;
+	for (int i = 0; i < numThreads; ++i)
+		threads.push_back(std::thread(&RenderJob::worker, this));
+}
+
+bool RenderJob::wait(int ms)
+{
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		if (ms < 0) finished.wait(lk, [this] { return running == 0; });
+		else if (!finished.wait_for(lk, std::chrono::milliseconds(ms),
+		                            [this] { return running == 0; }))
+			return false;
+	}
+	for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+	threads.clear();
+	return true;
+}
+
+void RenderJob::renderTile(int x0, int y0, int x1, int y1, Wavefront* wave)
+{
+	// the tile shares out its samples, whatever traces them
+	if (!progressive && traceUI->getAASize() > 1 && traceUI->adaptiveAA()) {
+		raytracer->adaptiveBlock(x0, y0, x1, y1, &stopped);
+		return;
+	}
+	if (!progressive && wave) {
+		wave->traceTile(x0, y0, x1, y1, &stopped);
+		return;
+	}
+	if (!progressive && packetSize > 1) {
+		for (int j = y0; j < y1 && !stopped; j += packetSize)
+			for (int i = x0; i < x1; i += packetSize)
+				raytracer->tracePixelBlock(i, j, std::min(i + packetSize, x1),
+				                           std::min(j + packetSize, y1), packetSize);
+		return;
+	}
+	if (!progressive) {
+		for (int j = y0; j < y1 && !stopped; ++j)
+			for (int i = x0; i < x1; ++i)
+				raytracer->tracePixel(i, j);
+		return;
+	}
+
+	// The preview passes trace sample 0 of every block-th pixel, skipping
+	// those done by a coarser pass; the pass after them fills in the rest.
+	int p = pass;
+	int sample = std::max(p - previewPasses, 0);
+	int block = p < previewPasses ? 8 >> p : 1;
+	int coarser = p <= previewPasses && p > 0 ? block * 2 : 0;
+	for (int j = y0; j < y1 && !stopped; ++j) {
+		if (j % block) continue;
+		for (int i = x0; i < x1 && !stopped; ++i) {
+			if (i % block) continue;
+			if (coarser && i % coarser == 0 && j % coarser == 0) continue;
+			raytracer->progressiveSample(i, j, sample, block);
+		}
+	}
+}
+
+bool RenderJob::nextPass()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	int p = pass;
+	if (++waiting == numThreads) {
+		// the last thread out of the pass sets up the next
+		waiting = 0;
+		++completedPasses;
+		if (p + 1 < numPasses) {
+			tiles.reset();
+			pass = p + 1;
+		}
+		passDone.notify_all();
+	} else {
+		passDone.wait(lk, [this, p] { return stopped || completedPasses > p; });
+	}
+	return !stopped && pass > p;
+}
+
+double RenderJob::seconds()
+{
+	std::lock_guard<std::mutex> lk(lock);
+	std::chrono::steady_clock::time_point end =
+		running > 0 ? std::chrono::steady_clock::now() : endTime;
+	return std::chrono::duration<double>(end - startTime).count();
+}
+
+void RenderJob::worker()
+{
+	renderCounters.clear();
+	// its queues are reused from tile to tile
+	std::unique_ptr<Wavefront> wave(wavefront ? new Wavefront(raytracer) : NULL);
+	int x0, y0, x1, y1;
+	do {
+		while (!stopped && tiles.pop(x0, y0, x1, y1)) {
+			renderTile(x0, y0, x1, y1, wave.get());
+			int done = ++finishedTiles;
+			if (onProgress) onProgress(done, tiles.size() * numPasses);
+		}
+	} while (!stopped && nextPass());
+
+	std::lock_guard<std::mutex> lk(lock);
+	totals.add(renderCounters);
+	if (--running == 0) {
+		endTime = std::chrono::steady_clock::now();
+		finished.notify_all();
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef __RENDERJOB_H__
+#define __RENDERJOB_H__
+
+// One render of the current scene, shared by the command line and the
+// graphical front ends.  start() launches the render threads, which take
+// tiles from a TileQueue until the image is done or cancel() is called;
+// the caller is free to do other work (keep a window alive, say) and
+// finally wait() for them.
+//
+// A progressive job renders in passes instead, each over the whole image:
+// first one sample per 8x8, 4x4 and 2x2 block for a quick preview, then
+// one more sample per pixel each pass.  The threads finish a pass before
+// starting the next, so the image is consistent after every pass and
+// equally good everywhere when the job is cancelled.  Cancelling one
+// stops it within a pixel: the pass under way is left partly done, with
+// the pixels it reached one sample ahead of the rest.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "TileQueue.h"
+#include "scene/renderstats.h"
+
+class RayTracer;
+class Wavefront;
+
+class RenderJob {
+public:
+	// Called on a render thread after each tile with the number of tiles
+	// finished so far; must be thread-safe.
+	typedef std::function<void(int done, int total)> ProgressCallback;
+
+	RenderJob(RayTracer* tracer, int width, int height, int threads, int tileSize);
+	~RenderJob();	// cancels and waits
+
+	void setProgressCallback(const ProgressCallback& cb) { onProgress = cb; }
+	// Before start(): render progressively, up to samples per pixel.
+	void setProgressive(int samples);
+	// Before start(): trace camera rays in packets of size x size, from
+	// blocks of as many pixels (see RayTracer::tracePixelBlock).  Only a
+	// one-shot job does; below 2 it traces pixel by pixel.
+	void setPacketSize(int size) { packetSize = std::min(size, 4); }
+	// Before start(): trace each tile breadth first (see Wavefront.h);
+	// only a one-shot job does.  Larger tiles make larger waves.
+	void setWavefront(bool on) { wavefront = on; }
+
+	void start();
+	// Tells the render threads to stop after the row they are on, or the
+	// pixel in a progressive job.  A tile traced breadth first is dropped
+	// at its next generation of rays, and an adaptive one at its next row
+	// of first samples, leaving their pixels as they were; an adaptive
+	// tile already refining is written with the samples it has.
+	void cancel();
+	// Waits up to ms milliseconds, or until done if ms is negative.
+	// Returns true once every render thread has finished.
+	bool wait(int ms = -1);
+
+	bool cancelled() const { return stopped; }
+	double progress() const { return double(finishedTiles) / (tiles.size() * numPasses); }
+	// Passes completed; a one-shot job has just the one.
+	int passesDone() const { return completedPasses; }
+	// Samples every pixel of a progressive job has, counting only the
+	// passes that were finished.
+	int samplesDone() const { return std::max(completedPasses - previewPasses, 0); }
+
+	// Wall clock time since start(), up to when the last thread finished.
+	double seconds();
+	// What the render threads did; complete once wait() returns true.
+	const RenderCounters& counters() const { return totals; }
+
+private:
+	void worker();
+	void renderTile(int x0, int y0, int x1, int y1, Wavefront* wave);
+	// Waits for the other threads to finish the pass; false if there is
+	// no next one.
+	bool nextPass();
+
+	RayTracer* raytracer;
+	int width, height;
+	int numThreads;
+	TileQueue tiles;
+	ProgressCallback onProgress;
+
+	std::vector<std::thread> threads;
+	std::atomic<bool> stopped;
+	std::atomic<int> finishedTiles;
+
+	bool progressive;
+	int packetSize;
+	bool wavefront;
+	int numPasses;
+	int previewPasses;	// the coarse block passes that open a progressive job
+	std::atomic<int> pass;	// changed only while all threads are in nextPass()
+	std::atomic<int> completedPasses;
+	int waiting;	// threads in nextPass(), guarded by lock
+	std::condition_variable passDone;
+
+	int running;	// guarded by lock, as are the two below
+	RenderCounters totals;
+	std::chrono::steady_clock::time_point startTime, endTime;
+	std::mutex lock;
+	std::condition_variable finished;
+
+	RenderJob(const RenderJob&);
+	RenderJob& operator =(const RenderJob&);
+};
+
+#endif // __RENDERJOB_H__
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <assert.h>
 #include "trimesh.h"
+#include "../scene/raypacket.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
@@ -12,13 +13,17 @@ Trimesh::~Trimesh()
 {
 	for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
 		delete *i;
+	for( Faces::iterator i = faces.begin(); i != faces.end(); ++i )
+		delete *i;
     if(kdtree) delete kdtree;
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
-    vertices.push_back( v );
+    vertices.push_back( Vec3f( float(v[0]), float(v[1]), float(v[2]) ) );
+    for( int k = 0; k < 3; ++k )
+        vertexScale = max(vertexScale, fabs(double(vertices.back()[k])));
 }
 
 void Trimesh::addMaterial( Material *m )
@@ -28,7 +33,7 @@ void Trimesh::addMaterial( Material *m )
 
 void Trimesh::addNormal( const Vec3d &n )
 {
-    normals.push_back( n );
+    normals.push_back( Vec3f( float(n[0]), float(n[1]), float(n[2]) ) );
 }
 
 // Returns false if the vertices a,b,c don't all exist
@@ -38,9 +43,10 @@ bool Trimesh::addFace( int a, int b, int c )
 
     if( a >= vcnt || b >= vcnt || c >= vcnt ) return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
+    TrimeshFace *newFace = new TrimeshFace( scene, this, a, b, c );
     newFace->setTransform(this->transform);
     if (!newFace->degen) faces.push_back( newFace );
+    else delete newFace;
 
 
     // Don't add faces to the scene's object list so we can cull by bounding box
@@ -48,6 +54,36 @@ bool Trimesh::addFace( int a, int b, int c )
     return true;
 }
 
+void Trimesh::buildKdTree(KdSplitMethod split)
+{
+    if(kdtree) delete kdtree;
+    kdtree = new KdTree<TrimeshFace>(faces, split, TRI_PACKET_WIDTH);
+    packTriangles();
+
+    opaque = !material->Trans();
+    for( Materials::const_iterator i = materials.begin(); i != materials.end(); ++i )
+        if( (*i)->Trans() ) opaque = false;
+}
+
+void Trimesh::packTriangles()
+{
+    packets.clear();
+    leafPackets.assign(kdtree->prims.size(), -1);
+    for( size_t n = 0; n < kdtree->nodes.size(); ++n )
+    {
+        const KdNode& node = kdtree->nodes[n];
+        if( !node.isLeaf() ) continue;
+        leafPackets[node.offset] = packets.size();
+        for( int j = 0; j < int(node.count); ++j )
+        {
+            if( j % TRI_PACKET_WIDTH == 0 ) packets.push_back(TriPacket());
+            const TrimeshFace* f = kdtree->prims[node.offset + j];
+            packets.back().set(j % TRI_PACKET_WIDTH, node.offset + j,
+                vertices[(*f)[0]], vertices[(*f)[1]], vertices[(*f)[2]]);
+        }
+    }
+}
+
 char* Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
@@ -64,93 +100,340 @@ bool Trimesh::intersectLocal(ray& r, isect& i) const
 {
 	bool have_one = false;
     if(kdtree && traceUI->useKdTree()) {
-        kdtree->intersect(r, i, have_one);
+        // The closest hit is turned into an isect once, at the end.
+        TriPacketRay pr(r.p, r.d, vertexScale);
+        const TrimeshFace* best = NULL;
+        double bestBeta = 0.0, bestGamma = 0.0;
+        double tMax = 1.0e308;
+        kdtree->closestHit(SlabRay(r), tMax, [&](int first, int count, double& t) {
+            leafClosest(first, count, r, pr, t, best, bestBeta, bestGamma);
+        });
+        if( best )
+        {
+            best->setHit(i, tMax, bestBeta, bestGamma);
+            have_one = true;
+        }
     } else {
-        double tmin = 0.0;
-        double tmax = 0.0;
+        renderCounters.triangleTests += faces.size();
+        TriPacketRay pr(r.p, r.d, vertexScale);
+        const TrimeshFace* best = NULL;
+        double bestT = 0.0, bestBeta = 0.0, bestGamma = 0.0;
         typedef Faces::const_iterator iter;
     	for( iter j = faces.begin(); j != faces.end(); ++j )
     	  {
-    	    isect cur;
-    	    if( (*j)->intersectLocal( r, cur ) )
+    	    double t, beta, gamma;
+    	    if( (*j)->intersectTriangle( r, pr, t, beta, gamma ) )
     	      {
-    		if( !have_one || (cur.t < i.t) )
+    		if( !best || (t < bestT) )
     		  {
-    		    i = cur;
-    		    have_one = true;
+    		    best = *j;
+    		    bestT = t;
+    		    bestBeta = beta;
+    		    bestGamma = gamma;
     		  }
     	      }
     	  }
+        if( best )
+        {
+            best->setHit(i, bestT, bestBeta, bestGamma);
+            have_one = true;
+        }
     }
 	if( !have_one ) i.setT(1000.0);
 	return have_one;
 }
 
-bool TrimeshFace::intersect(ray& r, isect& i) const {
-  return intersectLocal(r, i);
+bool Trimesh::occludedLocal(ray& r, double tmax, bool& translucent) const
+{
+    // Transmissive meshes need the material at the hit, which the plain
+    // closest-hit query provides.
+    if( !opaque ) return MaterialSceneObject::occludedLocal(r, tmax, translucent);
+    return anyFace(r, tmax);
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in alpha, beta and gamma.
+bool Trimesh::anyFace(ray& r, double tmax) const
+{
+    TriPacketRay pr(r.p, r.d, vertexScale);
+    if(kdtree && traceUI->useKdTree()) {
+        return kdtree->anyHit(SlabRay(r), tmax, [&](int first, int count) {
+            return leafOccluded(first, count, r, pr, tmax);
+        });
+    }
 
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+    for( Faces::const_iterator j = faces.begin(); j != faces.end(); ++j )
+    {
+        ++renderCounters.triangleTests;
+        double t, beta, gamma;
+        if( (*j)->intersectTriangle(r, pr, t, beta, gamma) && t < tmax ) return true;
+    }
+    return false;
+}
+
+void Trimesh::leafClosest(int first, int count, const ray& r, const TriPacketRay& pr, double& t,
+                          const TrimeshFace*& best, double& bestBeta, double& bestGamma) const
 {
+    renderCounters.triangleTests += count;
+    int end = leafPackets[first] + (count + TRI_PACKET_WIDTH - 1) / TRI_PACKET_WIDTH;
+    float beta[TRI_PACKET_WIDTH], gamma[TRI_PACKET_WIDTH];
+    for( int k = leafPackets[first]; k < end; ++k )
+    {
+        int mask = packets[k].hits(pr, float(min(t, double(FLT_MAX))), beta, gamma);
+        for( int l = 0; mask; ++l, mask >>= 1 )
+        {
+            if( !(mask & 1) ) continue;
+            const TrimeshFace* f = kdtree->prims[packets[k].face[l]];
+            double ft;
+            if( f->planeDistance(r, ft) && ft < t )
+            {
+                best = f;
+                t = ft;
+                bestBeta = beta[l];
+                bestGamma = gamma[l];
+            }
+        }
+    }
+}
 
-    const Vec3d& a = parent->vertices[ids[0]];
+bool Trimesh::leafOccluded(int first, int count, ray& r, const TriPacketRay& pr,
+                           double tmax) const
+{
+    renderCounters.triangleTests += count;
+    float ftmax = float(min(tmax, double(FLT_MAX)));
+    float beta[TRI_PACKET_WIDTH], gamma[TRI_PACKET_WIDTH];
+    int end = leafPackets[first] + (count + TRI_PACKET_WIDTH - 1) / TRI_PACKET_WIDTH;
+    for( int k = leafPackets[first]; k < end; ++k )
+    {
+        int mask = packets[k].hits(pr, ftmax, beta, gamma);
+        for( int l = 0; mask; ++l, mask >>= 1 )
+        {
+            double t;
+            if( (mask & 1) && kdtree->prims[packets[k].face[l]]->planeDistance(r, t) && t < tmax )
+                return true;
+        }
+    }
+    return false;
+}
 
-    Vec3d rpv = r.p - a;
-    double rd = n * r.d;
-    //parallel or intersect?
-    if(fabs(rd) < RAY_EPSILON) return false;
+int Trimesh::intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const
+{
+    if( !kdtree || !traceUI->useKdTree() ) return Geometry::intersectPacket(pk, slabs, mask);
+    return intersectPacketAs(*this, NULL, pk, slabs, mask);
+}
 
-    double t = -(n * rpv) / (rd);
-    if(t < RAY_EPSILON) return false;
+// The slabs for local, the packet in mesh space: the caller's if the
+// transform leaves the rays as they are, else own, set up from local.
+static const PacketSlabs& localSlabs(const TransformNode* transform, const PacketSlabs& slabs,
+                                     const RayPacket& local, PacketSlabs& own)
+{
+    if( transform->getKind() == TRANSFORM_IDENTITY ) return slabs;
+    own.set(local);
+    return own;
+}
 
-    //intersection point
-    Vec3d interP = r.p + t * r.d;
-    Vec3d pa = interP - a;
-    double pavab = pa * vab;
-    double pavac = pa * vac;
+// The packet walks the mesh's tree in mesh space; each ray's closest face
+// is then turned into a hit as Geometry::intersect() would.
+int Trimesh::intersectPacketAs(const Geometry& placed, const SceneObject* owner,
+                               RayPacket& pk, const PacketSlabs& slabs, int mask) const
+{
+    const TransformNode* transform = placed.getTransform();
+    const BoundingBox& bounds = placed.getBoundingBox();
+    RayPacket local;
+    local.size = pk.size;
+    TriPacketRay pr[RAY_PACKET_MAX];
+    double length[RAY_PACKET_MAX];
+    const TrimeshFace* best[RAY_PACKET_MAX];
+    double beta[RAY_PACKET_MAX], gamma[RAY_PACKET_MAX];
+    // a box entered past a ray's closest hit so far has nothing closer
+    Vec3d lo = bounds.getMin(), hi = bounds.getMax();
+    int live = slabs.hits(&lo[0], &hi[0], mask, pk.tMax);
+    transform->packetToLocal(pk, live, local, length);
+    for( int k = 0; k < pk.size; ++k )
+    {
+        if( !(live & (1 << k)) ) continue;
+        local.tMax[k] = 1.0e308;
+        pr[k] = TriPacketRay(local.rays[k].p, local.rays[k].d, vertexScale);
+        best[k] = NULL;
+    }
 
-    //in plane?
-    double beta = (abac * pavac - acac * pavab) * triArea;
-    if(beta < 0.0) return false;
+    PacketSlabs own;
+    kdtree->closestHitPacket(local, localSlabs(transform, slabs, local, own), local.tMax, live,
+                             [&](int first, int count, int m) {
+        for( int k = 0; k < local.size; ++k )
+            if( m & (1 << k) )
+                leafClosest(first, count, local.rays[k], pr[k], local.tMax[k], best[k], beta[k], gamma[k]);
+    });
 
-    double gamma = (abac * pavab - abab * pavac) * triArea;
-    if(gamma < 0.0 || gamma + beta > 1.0) return false;
+    int closer = 0;
+    for( int k = 0; k < pk.size; ++k )
+    {
+        if( !(live & (1 << k)) || !best[k] ) continue;
+        isect cur;
+        best[k]->setHit(cur, local.tMax[k], beta[k], gamma[k]);
+        if( owner ) cur.setObject(owner);
+        cur.N = transform->localToGlobalCoordsNormal(cur.N);
+        cur.t /= length[k];
+        if( cur.t < pk.tMax[k] )
+        {
+            pk.hits[k] = cur;
+            pk.tMax[k] = cur.t;
+            closer |= 1 << k;
+        }
+    }
+    pk.hit |= closer;
+    return closer;
+}
 
+int Trimesh::occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const
+{
+    if( !opaque || !kdtree || !traceUI->useKdTree() ) return Geometry::occludedPacket(pk, slabs, mask);
+    return occludedPacketAs(*this, pk, slabs, mask);
+}
+
+int Trimesh::occludedPacketAs(const Geometry& placed, RayPacket& pk, const PacketSlabs& slabs,
+                              int mask) const
+{
+    const TransformNode* transform = placed.getTransform();
+    const BoundingBox& bounds = placed.getBoundingBox();
+    RayPacket local;
+    local.size = pk.size;
+    TriPacketRay pr[RAY_PACKET_MAX];
+    double length[RAY_PACKET_MAX];
+    Vec3d lo = bounds.getMin(), hi = bounds.getMax();
+    int live = slabs.hits(&lo[0], &hi[0], mask, pk.tMax);
+    transform->packetToLocal(pk, live, local, length);
+    for( int k = 0; k < pk.size; ++k )
+    {
+        if( !(live & (1 << k)) ) continue;
+        local.tMax[k] = pk.tMax[k] * length[k];
+        pr[k] = TriPacketRay(local.rays[k].p, local.rays[k].d, vertexScale);
+    }
+
+    PacketSlabs own;
+    return kdtree->anyHitPacket(local, localSlabs(transform, slabs, local, own), local.tMax, live,
+                                [&](int first, int count, int m) {
+        int blocked = 0;
+        for( int k = 0; k < local.size; ++k )
+            if( (m & (1 << k)) && leafOccluded(first, count, local.rays[k], pr[k], local.tMax[k]) )
+                blocked |= 1 << k;
+        return blocked;
+    });
+}
+
+bool TrimeshInstance::intersectLocal(ray& r, isect& i) const
+{
+    if( !mesh->intersectLocal(r, i) ) return false;
+    if( overrides ) i.setObject(this);
+    return true;
+}
+
+bool TrimeshInstance::occludedLocal(ray& r, double tmax, bool& translucent) const
+{
+    if( !opaque() ) return MaterialSceneObject::occludedLocal(r, tmax, translucent);
+    return mesh->anyFace(r, tmax);
+}
+
+int TrimeshInstance::intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const
+{
+    if( !mesh->kdtree || !traceUI->useKdTree() ) return Geometry::intersectPacket(pk, slabs, mask);
+    return mesh->intersectPacketAs(*this, overrides ? this : NULL, pk, slabs, mask);
+}
+
+int TrimeshInstance::occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const
+{
+    if( !opaque() || !mesh->kdtree || !traceUI->useKdTree() ) return Geometry::occludedPacket(pk, slabs, mask);
+    return mesh->occludedPacketAs(*this, pk, slabs, mask);
+}
+
+bool TrimeshFace::intersect(ray& r, isect& i) const {
+  return intersectLocal(r, i);
+}
+
+// On an opaque mesh any hit closer than tmax occludes; otherwise the
+// material at the hit decides, as for any other object.
+bool TrimeshFace::occluded(ray& r, double tmax, bool& translucent) const {
+  if( !parent->opaque ) return Geometry::occludedLocal(r, tmax, translucent);
+  double t, beta, gamma;
+  TriPacketRay pr(r.p, r.d, parent->vertexScale);
+  return intersectTriangle(r, pr, t, beta, gamma) && t < tmax;
+}
+
+bool TrimeshFace::intersectTriangle(const ray& r, const TriPacketRay& pr,
+                                    double& t, double& beta, double& gamma) const
+{
+    const Trimesh::Vertices& v = parent->vertices;
+    if( !pr.hitsTriangle(v[ids[0]].getPointer(), v[ids[1]].getPointer(), v[ids[2]].getPointer(),
+                         FLT_MAX, beta, gamma) )
+        return false;
+    return planeDistance(r, t);
+}
+
+// The float test is watertight but only approximate in t, and secondary
+// rays start from r.at(t); so t is taken in double, from the same float
+// vertices, to leave them on the surface they came from.
+bool TrimeshFace::planeDistance(const ray& r, double& t) const
+{
+    Vec3d a = parent->vertex(ids[0]);
+    Vec3d n = (parent->vertex(ids[1]) - a) ^ (parent->vertex(ids[2]) - a);
+    double rd = n * r.d;
+    if(rd == 0.0) return false;
+    t = (n * (a - r.p)) / rd;
+    return t >= RAY_EPSILON;
+}
+
+// Intersect ray r with the triangle abc.  If it hits returns true,
+// and put the parameter in t and the barycentric coordinates of the
+// intersection in alpha, beta and gamma.
+
+bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+{
+    double t, beta, gamma;
+    TriPacketRay pr(r.p, r.d, parent->vertexScale);
+    if(!intersectTriangle(r, pr, t, beta, gamma)) return false;
+    setHit(i, t, beta, gamma);
+    return true;
+}
+
+void TrimeshFace::setHit(isect& i, double t, double beta, double gamma) const
+{
     double alpha = 1 - beta - gamma;
 
     Vec3d baryCoord = Vec3d(alpha, beta, gamma);
     i.setObject(this);
-
-    //material interpolation    
-    if(!parent->materials.empty()) {
-        Material m = alpha * (*parent->materials[ids[0]]);
-        m += beta * (*parent->materials[ids[1]]);
-        m += gamma * (*parent->materials[ids[2]]);
-        i.setMaterial(m);
-    } else i.setMaterial(this->getMaterial());
-
     i.setT(t);
     Vec3d N;
 
     //phong interpolation of normal
     if(!parent->normals.empty()) {
-        Vec3d interpN1 = alpha * parent->normals[ids[0]];
-        Vec3d interpN2 = beta * parent->normals[ids[1]];
-        Vec3d interpN3 = gamma * parent->normals[ids[2]];
+        Vec3d interpN1 = alpha * parent->normal(ids[0]);
+        Vec3d interpN2 = beta * parent->normal(ids[1]);
+        Vec3d interpN3 = gamma * parent->normal(ids[2]);
         N = interpN1 + interpN2 + interpN3;
         N.normalize();
-    } else N = normal;
+    } else N = getNormal();
 
     i.setN(N);
     Vec2d uv = Vec2d(beta, gamma);
     i.setUVCoordinates(uv);
     i.setBary(baryCoord);
-    return true;
+}
 
+// Per-vertex materials are interpolated only for hits that get shaded.
+const Material& TrimeshFace::materialAt(const isect& i, MaterialScratch& scratch) const
+{
+    if(parent->materials.empty()) return getMaterial();
+
+    Material& m = scratch.set(i.bary[0] * (*parent->materials[ids[0]]));
+    m += i.bary[1] * (*parent->materials[ids[1]]);
+    m += i.bary[2] * (*parent->materials[ids[2]]);
+    return m;
+}
+
+// The interpolated material keeps the flags of the first vertex's, as
+// Material's operator+= leaves them alone.
+bool TrimeshFace::isTranslucentAt(const isect&) const
+{
+    if(parent->materials.empty()) return getMaterial().Trans();
+    return parent->materials[ids[0]]->Trans();
 }
 
 void Trimesh::generateNormals()
@@ -158,7 +441,7 @@ void Trimesh::generateNormals()
 // vertex normals by averaging the normals of the neighboring faces.
 {
     int cnt = vertices.size();
-    normals.resize( cnt );
+    std::vector<Vec3d> sums( cnt );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
@@ -168,15 +451,17 @@ void Trimesh::generateNormals()
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
+            sums[(**fi)[i]] += faceNormal;
             ++numFaces[(**fi)[i]];
         }
     }
 
+    normals.resize( cnt );
     for( int i = 0; i < cnt; ++i )
     {
         if( numFaces[i] )
-            normals[i]  /= numFaces[i];
+            sums[i]  /= numFaces[i];
+        normals[i] = Vec3f( float(sums[i][0]), float(sums[i][1]), float(sums[i][2]) );
     }
 
     delete [] numFaces;
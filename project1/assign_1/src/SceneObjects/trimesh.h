@@ -7,14 +7,18 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
+#include "tripacket.h"
 
 class TrimeshFace;
 
 class Trimesh : public MaterialSceneObject
 {
     friend class TrimeshFace;
-    typedef std::vector<Vec3d> Normals;
-    typedef std::vector<Vec3d> Vertices;
+    friend class TrimeshInstance;
+    // Stored in single precision, which halves the memory of a big mesh;
+    // shading works in double (see vertex() and normal()).
+    typedef std::vector<Vec3f> Normals;
+    typedef std::vector<Vec3f> Vertices;
     typedef std::vector<Material*> Materials;
     typedef std::vector<TrimeshFace*> Faces;
     Vertices vertices;
@@ -24,10 +28,9 @@ class Trimesh : public MaterialSceneObject
 
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat), 
-			displayListWithMaterials(0),
-			displayListWithoutMaterials(0),
-            kdtree(NULL), faces()
+        : MaterialSceneObject(scene, mat), kdtree(NULL), faces(),
+			displayListWithMaterials(0), opaque(false),
+			displayListWithoutMaterials(0), vertexScale(0.0)
     {
       this->transform = transform;
       vertNorms = false;
@@ -37,10 +40,13 @@ public:
     KdTree<TrimeshFace>* kdtree;
     Faces faces;
     bool intersectLocal(ray& r, isect& i) const;
+    bool occludedLocal(ray& r, double tmax, bool& translucent) const;
+    int intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
+    int occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
     bool isTrimesh() const { return true; }
-    void buildKdTree() {
-        if(kdtree) delete kdtree;
-        kdtree = new KdTree<TrimeshFace>(faces, 0);
+    void buildKdTree(KdSplitMethod split);
+    void collectKdTreeStats(KdTreeStats& s) const {
+        if(kdtree) kdtree->collectStats(s);
     }
 
     ~Trimesh();
@@ -61,74 +67,118 @@ public:
     {
         BoundingBox localbounds;
 		if (vertices.size() == 0) return localbounds;
-		localbounds.setMax(vertices[0]);
-		localbounds.setMin(vertices[0]);
-		Vertices::const_iterator viter;
-		for (viter = vertices.begin(); viter != vertices.end(); ++viter)
+		localbounds.setMax(vertex(0));
+		localbounds.setMin(vertex(0));
+		for (size_t v = 0; v < vertices.size(); ++v)
 	  {
-	    localbounds.setMax(maximum( localbounds.getMax(), *viter));
-	    localbounds.setMin(minimum( localbounds.getMin(), *viter));
+	    localbounds.setMax(maximum( localbounds.getMax(), vertex(v)));
+	    localbounds.setMin(minimum( localbounds.getMin(), vertex(v)));
 	  }
 		localBounds = localbounds;
         return localbounds;
     }
 
+    // Vertex and normal i, widened to double; exactly, so bounds and
+    // planes taken from them hold for the float data too.
+    Vec3d vertex(int i) const
+        { const Vec3f& v = vertices[i]; return Vec3d(v[0], v[1], v[2]); }
+    Vec3d normal(int i) const
+        { const Vec3f& n = normals[i]; return Vec3d(n[0], n[1], n[2]); }
+
 protected:
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
 	mutable int displayListWithMaterials;
+	// No material on the mesh transmits, so shadow rays can stop at
+	// any face.  Set up by buildKdTree().
+	bool opaque;
 	mutable int displayListWithoutMaterials;
+
+	// The faces of each kd-tree leaf, packed for SIMD tests; indexed by
+	// the leaf's first entry in kdtree->prims.  Set up by buildKdTree().
+	std::vector<TriPacket> packets;
+	std::vector<int> leafPackets;
+	// largest coordinate magnitude, which bounds the float rounding error
+	double vertexScale;
+	void packTriangles();
+	// The tests of one ray against the packed faces of the leaf at first.
+	void leafClosest(int first, int count, const ray& r, const TriPacketRay& pr, double& t,
+	                 const TrimeshFace*& best, double& beta, double& gamma) const;
+	bool leafOccluded(int first, int count, ray& r, const TriPacketRay& pr, double tmax) const;
+	// occludedLocal() as if every face were opaque.
+	bool anyFace(ray& r, double tmax) const;
+	// The packet queries of this mesh placed as placed: in its space and
+	// bounds.  Hits are reported on owner, or on the faces if it is NULL;
+	// occludedPacketAs() treats every face as opaque.  slabs is the
+	// caller's, for pk; the rays are set up again only if placed's
+	// transform moves them.
+	int intersectPacketAs(const Geometry& placed, const SceneObject* owner,
+	                      RayPacket& pk, const PacketSlabs& slabs, int mask) const;
+	int occludedPacketAs(const Geometry& placed, RayPacket& pk, const PacketSlabs& slabs,
+	                     int mask) const;
 };
 
+// Another placement of a Trimesh, under its own transform, sharing the
+// mesh's faces and kd-tree instead of copying them.  With its own
+// material it overrides all of the mesh's; otherwise hits are on the
+// mesh's faces and take their materials.
+class TrimeshInstance : public MaterialSceneObject
+{
+public:
+    // mat is the instance's material, which overrides the mesh's if
+    // overrides is set.
+    TrimeshInstance( Scene *scene, Material *mat, TransformNode *transform,
+                     const Trimesh *mesh, bool overrides )
+        : MaterialSceneObject(scene, mat), mesh(mesh), overrides(overrides)
+    {
+        this->transform = transform;
+    }
+
+    bool intersectLocal(ray& r, isect& i) const;
+    bool occludedLocal(ray& r, double tmax, bool& translucent) const;
+    int intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
+    int occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
+
+    bool hasBoundingBoxCapability() const { return true; }
+    BoundingBox ComputeLocalBoundingBox() { return mesh->localBounds; }
+
+protected:
+    void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+        { mesh->glDrawLocal(quality, actualMaterials, actualTextures); }
+
+private:
+    // Whether every face is opaque, so shadow rays can stop at any.
+    bool opaque() const { return overrides ? !material->Trans() : mesh->opaque; }
+
+    const Trimesh *mesh;
+    bool overrides;
+};
+
+// A face keeps no more than its vertices' indices and its bounds; what
+// the tests and shading need is taken from the mesh's vertices as it is
+// needed, which keeps big meshes small.
 class TrimeshFace : public MaterialSceneObject
 {
     Trimesh *parent;
     int ids[3];
-    Vec3d normal;
-    double dist;
-    double triArea;
-    Vec3d n;
-    Vec3d vab;
-    Vec3d vac;
-    double abab;
-    double acac;
-    double abac;
 
 public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
+    // Faces have no material of their own; they use the mesh's.
+    TrimeshFace( Scene *scene, Trimesh *parent, int a, int b, int c)
+        : MaterialSceneObject( scene, NULL )
     {
         this->parent = parent;
         ids[0] = a;
         ids[1] = b;
         ids[2] = c;
 
-		// Compute the face normal here, not on the fly
-		Vec3d a_coords = parent->vertices[a];
-		Vec3d b_coords = parent->vertices[b];
-		Vec3d c_coords = parent->vertices[c];
-
-		vab = (b_coords - a_coords);
-		vac = (c_coords - a_coords);
-		Vec3d vcb = (b_coords - c_coords);
-
-        
-		if (vab.iszero() || vac.iszero() || vcb.iszero()) degen = true;
-		else {
-			degen = false;
-			normal = vab ^ vac;
-            n = normal;
-			normal.normalize();
-			dist = normal * a_coords;
-            abab = vab * vab;
-            acac = vac * vac;
-            abac = vab * vac;
-            triArea = 1 / (abac * abac - abab * acac);
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds = localbounds;
+		Vec3d a_coords = parent->vertex(a);
+		Vec3d b_coords = parent->vertex(b);
+		Vec3d c_coords = parent->vertex(c);
+		degen = (b_coords - a_coords).iszero() || (c_coords - a_coords).iszero() ||
+		        (b_coords - c_coords).iszero();
+		bounds = ComputeLocalBoundingBox();
     }
 
-	BoundingBox localbounds;
 	bool degen;
 
     int operator[]( int i ) const
@@ -136,29 +186,46 @@ public:
         return ids[i];
     }
 
-	Vec3d getNormal()
+	// The unit normal of the plane through the vertices.
+	Vec3d getNormal() const
 	{
+		Vec3d a = parent->vertex(ids[0]);
+		Vec3d normal = (parent->vertex(ids[1]) - a) ^ (parent->vertex(ids[2]) - a);
+		normal.normalize();
 		return normal;
 	}
 
+    const Material& getMaterial() const { return parent->getMaterial(); }
+    const Material& materialAt(const isect& i, MaterialScratch& scratch) const;
+    bool isTranslucentAt(const isect& i) const;
+
     bool intersect(ray& r, isect& i ) const;
     bool intersectLocal(ray& r, isect& i ) const;
+    bool occluded(ray& r, double tmax, bool& translucent) const;
+
+    // The bare ray/triangle test: parameter and barycentric coordinates.
+    // pr is r set up for the mesh (see TriPacketRay).
+    bool intersectTriangle(const ray& r, const TriPacketRay& pr,
+                           double& t, double& beta, double& gamma) const;
+    // The parameter at which r meets the face's plane, if it is past
+    // RAY_EPSILON; the test above has already decided that it hits.
+    bool planeDistance(const ray& r, double& t) const;
+    // Fills in i for a hit found by intersectTriangle().
+    void setHit(isect& i, double t, double beta, double gamma) const;
 
     bool hasBoundingBoxCapability() const { return true; }
       
     BoundingBox ComputeLocalBoundingBox()
     {
         BoundingBox localbounds;
-        localbounds.setMax(maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-		localbounds.setMin(minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
+        localbounds.setMax(maximum( parent->vertex(ids[0]), parent->vertex(ids[1])));
+		localbounds.setMin(minimum( parent->vertex(ids[0]), parent->vertex(ids[1])));
         
-        localbounds.setMax(maximum( parent->vertices[ids[2]], localbounds.getMax()));
-		localbounds.setMin(minimum( parent->vertices[ids[2]], localbounds.getMin()));
+        localbounds.setMax(maximum( parent->vertex(ids[2]), localbounds.getMax()));
+		localbounds.setMin(minimum( parent->vertex(ids[2]), localbounds.getMin()));
         return localbounds;
     }
 
-    const BoundingBox& getBoundingBox() const { return localbounds; }
-
  };
 
 #endif // TRIMESH_H__
@@ -0,0 +1,252 @@
+//
+// tripacket.h
+//
+// Triangles packed TRI_PACKET_WIDTH at a time in structure-of-arrays form
+// for watertight ray/triangle tests that run on all of them at once: 8
+// wide with AVX, 4 wide with SSE, and a plain loop over 4 lanes otherwise.
+//
+// Mesh vertices are stored in single precision, and the test is the one
+// of Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection"
+// (JCGT 2013): each vertex is moved into a space where the ray runs down
+// the z axis from the origin, and the ray hits the triangle when its
+// three edge functions there agree in sign.  A vertex is transformed the
+// same way for every triangle that shares it, so neighbouring triangles
+// see exactly the same shared edge and a ray cannot slip between them.
+// The packed test takes the edge functions in float, and any lane where
+// one of them is not clear of zero by more than its rounding error is
+// redone in double, where the products of floats are exact.  So every
+// path decides on the exact signs, and a triangle tested one way agrees
+// with its neighbour tested the other.
+//
+// Which triangles a ray hits is decided here; the distances are only
+// filtered, generously.  Trimesh takes each hit's exact distance from
+// the double precision plane of its (float) vertices.
+//
+
+#ifndef TRIPACKET_H__
+#define TRIPACKET_H__
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "../vecmath/vec.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+const int TRI_PACKET_WIDTH = 8;
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+const int TRI_PACKET_WIDTH = 4;
+#else
+const int TRI_PACKET_WIDTH = 4;
+#endif
+
+// Slack on t, relative to the size of the mesh.
+const float TRI_PACKET_SLACK = 1.0e-4f;
+
+// A float edge function a*b - c*d is within (2e + e^2)(|a*b| + |c*d|) of
+// the exact one, for e = FLT_EPSILON / 2; this bound covers that and the
+// rounding in computing it.  The FLT_MIN covers products that underflow.
+const float TRI_EDGE_ERROR = 2.0f * FLT_EPSILON;
+
+// A ray set up once for testing against many triangles.
+struct TriPacketRay {
+  TriPacketRay() {}
+  // scale: the largest coordinate magnitude of the mesh's vertices
+  TriPacketRay(const Vec3d& p, const Vec3d& d, double scale) {
+    double pmax = scale;
+    for(int a = 0; a < 3; ++a) {
+      o[a] = float(p[a]);
+      pmax = std::max(pmax, std::fabs(p[a]));
+    }
+    // z is the direction's largest axis; swapping x and y when it points
+    // down z keeps the triangles' winding
+    kz = 0;
+    if(std::fabs(d[1]) > std::fabs(d[kz])) kz = 1;
+    if(std::fabs(d[2]) > std::fabs(d[kz])) kz = 2;
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if(d[kz] < 0.0) std::swap(kx, ky);
+    sx = float(d[kx] / d[kz]);
+    sy = float(d[ky] / d[kz]);
+    sz = float(1.0 / d[kz]);
+    tEps = float(TRI_PACKET_SLACK * pmax / d.length());
+  }
+
+  // The test against the triangle abc, for 0 < t < tMax up to tEps.  The
+  // edge functions are taken in double, so their signs are exact; this
+  // is what the packed test falls back to, and what single faces use.
+  bool hitsTriangle(const float* a, const float* b, const float* c, float tMax,
+                    double& beta, double& gamma) const {
+    float az = a[kz] - o[kz], bz = b[kz] - o[kz], cz = c[kz] - o[kz];
+    float ax = (a[kx] - o[kx]) - sx * az, ay = (a[ky] - o[ky]) - sy * az;
+    float bx = (b[kx] - o[kx]) - sx * bz, by = (b[ky] - o[ky]) - sy * bz;
+    float cx = (c[kx] - o[kx]) - sx * cz, cy = (c[ky] - o[ky]) - sy * cz;
+
+    double u = double(cx) * by - double(cy) * bx;
+    double v = double(ax) * cy - double(ay) * cx;
+    double w = double(bx) * ay - double(by) * ax;
+    if((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) return false;
+    double det = u + v + w;
+    if(det == 0.0) return false;
+
+    double t = (u * az + v * bz + w * cz) * sz / det;
+    if(!(t > -tEps && t < tMax + tEps)) return false;
+    beta = v / det;
+    gamma = w / det;
+    return true;
+  }
+
+  float o[3];
+  int kx, ky, kz;   // the axes of the ray's space
+  float sx, sy, sz; // the shear onto them
+  float tEps;       // slack on t, for rounding in o and the shear
+};
+
+struct TriPacket {
+  float v[3][3][TRI_PACKET_WIDTH]; // vertex, axis, lane
+  int face[TRI_PACKET_WIDTH];      // index into the owner's face list, -1 if unused
+  int used;                        // bit l is set if lane l has a face
+
+  TriPacket() : used(0) {
+    for(int l = 0; l < TRI_PACKET_WIDTH; ++l) {
+      for(int k = 0; k < 3; ++k)
+        for(int a = 0; a < 3; ++a) v[k][a][l] = 0.0f;
+      face[l] = -1;
+    }
+  }
+
+  void set(int lane, int f, const Vec3f& a, const Vec3f& b, const Vec3f& c) {
+    for(int k = 0; k < 3; ++k) {
+      v[0][k][lane] = a[k];
+      v[1][k][lane] = b[k];
+      v[2][k][lane] = c[k];
+    }
+    face[lane] = f;
+    used |= 1 << lane;
+  }
+
+  // Bit l is set if the ray hits lane l's triangle with 0 < t < tMax,
+  // up to the ray's tEps; its barycentric coordinates go in beta[l] and
+  // gamma[l].
+  int hits(const TriPacketRay& r, float tMax, float* beta, float* gamma) const;
+
+private:
+  // hitsTriangle() on lane l.
+  bool laneHits(int l, const TriPacketRay& r, float tMax, float& beta, float& gamma) const {
+    float a[3], b[3], c[3];
+    for(int k = 0; k < 3; ++k) {
+      a[k] = v[0][k][l];
+      b[k] = v[1][k][l];
+      c[k] = v[2][k][l];
+    }
+    double bb, gg;
+    if(!r.hitsTriangle(a, b, c, tMax, bb, gg)) return false;
+    beta = float(bb);
+    gamma = float(gg);
+    return true;
+  }
+};
+
+#if defined(__AVX__) || defined(__SSE2__)
+
+// Just enough of a float vector type to write the kernel once.
+#if defined(__AVX__)
+struct TriLanes {
+  TriLanes(__m256 x) : v(x) {}
+  __m256 v;
+};
+inline TriLanes triSet(float f) { return _mm256_set1_ps(f); }
+inline TriLanes triLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline void triStore(float* p, TriLanes a) { _mm256_storeu_ps(p, a.v); }
+inline TriLanes operator +(TriLanes a, TriLanes b) { return _mm256_add_ps(a.v, b.v); }
+inline TriLanes operator -(TriLanes a, TriLanes b) { return _mm256_sub_ps(a.v, b.v); }
+inline TriLanes operator *(TriLanes a, TriLanes b) { return _mm256_mul_ps(a.v, b.v); }
+inline TriLanes operator /(TriLanes a, TriLanes b) { return _mm256_div_ps(a.v, b.v); }
+inline TriLanes triAnd(TriLanes a, TriLanes b) { return _mm256_and_ps(a.v, b.v); }
+inline TriLanes triOr(TriLanes a, TriLanes b) { return _mm256_or_ps(a.v, b.v); }
+inline TriLanes triGreater(TriLanes a, TriLanes b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline TriLanes triLess(TriLanes a, TriLanes b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline TriLanes triGreaterEqual(TriLanes a, TriLanes b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline TriLanes triLessEqual(TriLanes a, TriLanes b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline int triMask(TriLanes a) { return _mm256_movemask_ps(a.v); }
+inline TriLanes triAbs(TriLanes a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+#else
+struct TriLanes {
+  TriLanes(__m128 x) : v(x) {}
+  __m128 v;
+};
+inline TriLanes triSet(float f) { return _mm_set1_ps(f); }
+inline TriLanes triLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void triStore(float* p, TriLanes a) { _mm_storeu_ps(p, a.v); }
+inline TriLanes operator +(TriLanes a, TriLanes b) { return _mm_add_ps(a.v, b.v); }
+inline TriLanes operator -(TriLanes a, TriLanes b) { return _mm_sub_ps(a.v, b.v); }
+inline TriLanes operator *(TriLanes a, TriLanes b) { return _mm_mul_ps(a.v, b.v); }
+inline TriLanes operator /(TriLanes a, TriLanes b) { return _mm_div_ps(a.v, b.v); }
+inline TriLanes triAnd(TriLanes a, TriLanes b) { return _mm_and_ps(a.v, b.v); }
+inline TriLanes triOr(TriLanes a, TriLanes b) { return _mm_or_ps(a.v, b.v); }
+inline TriLanes triGreater(TriLanes a, TriLanes b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline TriLanes triLess(TriLanes a, TriLanes b) { return _mm_cmplt_ps(a.v, b.v); }
+inline TriLanes triGreaterEqual(TriLanes a, TriLanes b) { return _mm_cmpge_ps(a.v, b.v); }
+inline TriLanes triLessEqual(TriLanes a, TriLanes b) { return _mm_cmple_ps(a.v, b.v); }
+inline int triMask(TriLanes a) { return _mm_movemask_ps(a.v); }
+inline TriLanes triAbs(TriLanes a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+#endif
+
+// Set in the lanes where the edge function p - q, of the float products
+// p and q, might not have the sign of the exact one.
+inline TriLanes triUnsure(TriLanes p, TriLanes q) {
+  TriLanes err = (triAbs(p) + triAbs(q)) * triSet(TRI_EDGE_ERROR) + triSet(FLT_MIN);
+  return triLessEqual(triAbs(p - q), err);
+}
+
+inline int TriPacket::hits(const TriPacketRay& r, float tMax, float* beta, float* gamma) const {
+  TriLanes ox = triSet(r.o[r.kx]), oy = triSet(r.o[r.ky]), oz = triSet(r.o[r.kz]);
+  TriLanes sx = triSet(r.sx), sy = triSet(r.sy);
+
+  // the vertices in the ray's space, as in hitsTriangle()
+  TriLanes az = triLoad(v[0][r.kz]) - oz, bz = triLoad(v[1][r.kz]) - oz, cz = triLoad(v[2][r.kz]) - oz;
+  TriLanes ax = (triLoad(v[0][r.kx]) - ox) - sx * az, ay = (triLoad(v[0][r.ky]) - oy) - sy * az;
+  TriLanes bx = (triLoad(v[1][r.kx]) - ox) - sx * bz, by = (triLoad(v[1][r.ky]) - oy) - sy * bz;
+  TriLanes cx = (triLoad(v[2][r.kx]) - ox) - sx * cz, cy = (triLoad(v[2][r.ky]) - oy) - sy * cz;
+
+  TriLanes u1 = cx * by, u2 = cy * bx;
+  TriLanes v1 = ax * cy, v2 = ay * cx;
+  TriLanes w1 = bx * ay, w2 = by * ax;
+  TriLanes u = u1 - u2, vv = v1 - v2, w = w1 - w2;
+
+  // Lanes where rounding might have changed an edge function's sign are
+  // redone exactly; elsewhere the float signs are the exact ones.
+  TriLanes zero = triSet(0.0f);
+  int exact = triMask(triOr(triOr(triUnsure(u1, u2), triUnsure(v1, v2)), triUnsure(w1, w2))) & used;
+
+  TriLanes inside = triOr(
+      triAnd(triAnd(triGreaterEqual(u, zero), triGreaterEqual(vv, zero)), triGreaterEqual(w, zero)),
+      triAnd(triAnd(triLessEqual(u, zero), triLessEqual(vv, zero)), triLessEqual(w, zero)));
+  TriLanes det = u + vv + w;
+  TriLanes inv = triSet(1.0f) / det;
+  TriLanes t = (u * az + vv * bz + w * cz) * triSet(r.sz) * inv;
+  TriLanes hit = triAnd(inside, triGreater(t, triSet(-r.tEps)));
+  hit = triAnd(hit, triLess(t, triSet(tMax + r.tEps)));
+  triStore(beta, vv * inv);
+  triStore(gamma, w * inv);
+
+  int mask = triMask(hit) & used & ~exact;
+  for(int l = 0; exact; ++l, exact >>= 1)
+    if((exact & 1) && laneHits(l, r, tMax, beta[l], gamma[l])) mask |= 1 << l;
+  return mask;
+}
+
+#else
+
+inline int TriPacket::hits(const TriPacketRay& r, float tMax, float* beta, float* gamma) const {
+  int mask = 0;
+  for(int l = 0; l < TRI_PACKET_WIDTH; ++l)
+    if((used & (1 << l)) && laneHits(l, r, tMax, beta[l], gamma[l])) mask |= 1 << l;
+  return mask;
+}
+
+#endif
+
+#endif // TRIPACKET_H__
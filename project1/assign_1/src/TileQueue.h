@@ -0,0 +1,43 @@
+#ifndef __TILEQUEUE_H__
+#define __TILEQUEUE_H__
+
+// Hands out the square tiles of an image, row by row, to any number of
+// render threads.  Small tiles keep every thread busy until the end even
+// when some parts of the image (glass, say) cost far more than others.
+
+#include <atomic>
+#include <algorithm>
+
+class TileQueue {
+public:
+	TileQueue(int w, int h, int tile)
+		: width(w), height(h), tileSize(std::max(tile, 1)), next(0)
+	{
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+	}
+
+	int size() const { return tilesX * tilesY; }
+
+	// Hands out every tile again; only while nobody is popping.
+	void reset() { next = 0; }
+
+	// Claims the next tile, [x0,x1) x [y0,y1); false once all are taken.
+	bool pop(int& x0, int& y0, int& x1, int& y1)
+	{
+		int t = next++;
+		if (t >= size()) return false;
+		x0 = (t % tilesX) * tileSize;
+		y0 = (t / tilesX) * tileSize;
+		x1 = std::min(x0 + tileSize, width);
+		y1 = std::min(y0 + tileSize, height);
+		return true;
+	}
+
+private:
+	int width, height, tileSize;
+	int tilesX, tilesY;
+	std::atomic<int> next;
+};
+
+#endif // __TILEQUEUE_H__
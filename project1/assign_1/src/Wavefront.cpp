@@ -0,0 +1,233 @@
+#include <algorithm>
+
+#include "Wavefront.h"
+#include "RayTracer.h"
+#include "ui/TraceUI.h"
+#include "scene/scene.h"
+#include "scene/light.h"
+#include "scene/material.h"
+#include "scene/raypacket.h"
+#include "scene/renderstats.h"
+
+extern TraceUI* traceUI;
+
+void Wavefront::traceTile(int x0, int y0, int x1, int y1, const std::atomic<bool>* stop)
+{
+	if (!raytracer->sceneLoaded()) return;
+
+	// Adaptive pixels choose their samples as they go, and debugging
+	// records each ray as traceRay() traces it.
+	if (traceUI->getAASize() > 1 && traceUI->adaptiveAA()) {
+		raytracer->adaptiveBlock(x0, y0, x1, y1, stop);
+		return;
+	}
+	if (TraceUI::m_debug) {
+		for (int j = y0; j < y1; ++j)
+			for (int i = x0; i < x1; ++i)
+				raytracer->tracePixel(i, j);
+		return;
+	}
+
+	generate(x0, y0, x1, y1);
+	int cameraRays = paths.size();
+	while (!queue.empty()) {
+		if (stop && *stop) return;
+		intersect();
+		shadow();
+		shade();
+		spawn();
+		queue.swap(next);
+	}
+	resolve();
+
+	// each pixel adds up its samples in tracePixel()'s order
+	int aaSize = traceUI->getAASize();
+	sums.assign((x1 - x0) * (y1 - y0), Vec3d(0, 0, 0));
+	for (int k = 0; k < cameraRays; ++k) sums[owner[k]] += paths[k].color;
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			Vec3d col = sums[(i - x0) + (j - y0) * (x1 - x0)];
+			if (aaSize > 1) col /= (aaSize * aaSize);
+			raytracer->setPixel(i, j, col, aaSize * aaSize);
+		}
+	}
+}
+
+// The camera rays of every sample, pixel by pixel, as in tracePixel().
+void Wavefront::generate(int x0, int y0, int x1, int y1)
+{
+	int aaSize = traceUI->getAASize();
+	int depth = traceUI->getDepth();
+	double xIncr = 1.0 / (double(raytracer->buffer_width) * aaSize);
+	double yIncr = 1.0 / (double(raytracer->buffer_height) * aaSize);
+
+	paths.clear();
+	queue.clear();
+	owner.clear();
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			double x = double(i)/double(raytracer->buffer_width);
+			double y = double(j)/double(raytracer->buffer_height);
+			for (int xOffset = 0; xOffset < aaSize; ++xOffset) {
+				for (int yOffset = 0; yOffset < aaSize; ++yOffset) {
+					ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+					raytracer->scene->getCamera().rayThrough(x + xOffset * xIncr, y + yOffset * yIncr, r);
+					queue.push_back(paths.size());
+					owner.push_back((i - x0) + (j - y0) * (x1 - x0));
+					paths.push_back(child(r, depth));
+				}
+			}
+		}
+	}
+}
+
+// The queue, RAY_PACKET_MAX rays at a time; misses take the background.
+void Wavefront::intersect()
+{
+	hits.clear();
+	for (size_t s = 0; s < queue.size(); s += RAY_PACKET_MAX) {
+		RayPacket pk;
+		int n = std::min<int>(RAY_PACKET_MAX, queue.size() - s);
+		for (int k = 0; k < n; ++k) {
+			const ray& r = paths[queue[s + k]].r;
+			++renderCounters.rays[r.type()];
+			pk.add(r);
+		}
+		raytracer->scene->intersect(pk);
+		for (int k = 0; k < n; ++k) {
+			PathRay& p = paths[queue[s + k]];
+			p.hasHit = (pk.hit & (1 << k)) != 0;
+			if (p.hasHit) {
+				p.hit = pk.hits[k];
+				hits.push_back(queue[s + k]);
+			} else p.color = raytracer->background(p.r);
+		}
+	}
+}
+
+// Every hit's shadow rays to one light, then the next light.
+void Wavefront::shadow()
+{
+	const Scene* scene = raytracer->scene;
+	int numLights = scene->endLights() - scene->beginLights();
+	shadows.resize(hits.size() * numLights);
+	int l = 0;
+	for (Scene::cliter light = scene->beginLights(); light != scene->endLights(); ++light, ++l) {
+		for (size_t s = 0; s < hits.size(); s += RAY_PACKET_MAX) {
+			Vec3d points[RAY_PACKET_MAX], atten[RAY_PACKET_MAX];
+			int n = std::min<int>(RAY_PACKET_MAX, hits.size() - s);
+			for (int k = 0; k < n; ++k) {
+				const PathRay& p = paths[hits[s + k]];
+				points[k] = p.r.at(p.hit.t);
+			}
+			raytracer->shadowPacket(*light, points, n, atten);
+			for (int k = 0; k < n; ++k) shadows[(s + k) * numLights + l] = atten[k];
+		}
+	}
+}
+
+// The hits grouped by object, and so by material, so each material's
+// code and textures are used for a run of hits at a time.  Each hit's
+// material is worked out once, here, for its shading, its reflected and
+// refracted rays, and their weights.
+void Wavefront::shade()
+{
+	Scene* scene = raytracer->scene;
+	int numLights = scene->endLights() - scene->beginLights();
+	order.resize(hits.size());
+	for (size_t k = 0; k < hits.size(); ++k) order[k] = k;
+	std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+		return paths[hits[a]].hit.obj < paths[hits[b]].hit.obj;
+	});
+	next.clear();
+	for (size_t k = 0; k < order.size(); ++k) {
+		int from = hits[order[k]];
+		const Vec3d* atten = numLights ? &shadows[order[k] * numLights] : NULL;
+		MaterialScratch scratch;
+		const Material& m = paths[from].hit.getMaterial(scratch);
+		paths[from].color = m.shade(scene, paths[from].r, paths[from].hit, atten);
+		if (paths[from].depth < 1) continue;
+
+		// paths grows below, so from is looked up again each time
+		ray reflected, refracted;
+		int spawned = RayTracer::secondaryRays(paths[from].r, paths[from].hit, m, reflected, refracted);
+		if (spawned & RayTracer::SPAWN_REFLECTION) {
+			paths[from].kr = m.kr(paths[from].hit);
+			paths[from].reflected = paths.size();
+			next.push_back(paths.size());
+			paths.push_back(child(reflected, paths[from].depth - 1));
+		}
+		if (spawned & RayTracer::SPAWN_REFRACTION) {
+			paths[from].kt = m.kt(paths[from].hit);
+			paths[from].refracted = paths.size();
+			next.push_back(paths.size());
+			paths.push_back(child(refracted, paths[from].depth - 1));
+		}
+	}
+}
+
+// Spreads the low 10 bits of v out to every third bit.
+static unsigned long long spreadBits(unsigned int v)
+{
+	unsigned long long x = v & 0x3ff;
+	x = (x | (x << 16)) & 0x30000ffULL;
+	x = (x | (x << 8)) & 0x300f00fULL;
+	x = (x | (x << 4)) & 0x30c30c3ULL;
+	x = (x | (x << 2)) & 0x9249249ULL;
+	return x;
+}
+
+// Sorts rays by the octant of their direction, then along a Morton
+// (Z-order) curve through their origins on a 1024^3 grid over bounds.
+static unsigned long long binKey(const ray& r, const BoundingBox& bounds)
+{
+	const Vec3d& d = r.getDirection();
+	unsigned long long octant = (d[0] < 0) | ((d[1] < 0) << 1) | ((d[2] < 0) << 2);
+	Vec3d lo = bounds.getMin(), hi = bounds.getMax();
+	unsigned long long morton = 0;
+	for (int a = 0; a < 3; ++a) {
+		double extent = hi[a] - lo[a];
+		double f = extent > 0 ? (r.getPosition()[a] - lo[a]) / extent : 0;
+		unsigned int cell = (unsigned int)(std::min(std::max(f, 0.0), 1.0) * 1023.0);
+		morton |= spreadBits(cell) << a;
+	}
+	return (octant << 30) | morton;
+}
+
+// The next generation, as shade() left it: what the hits reflect and
+// refract.  Those come off every surface in the tile in every direction,
+// so before they are traced they are binned by direction and origin (see
+// binKey()), which puts rays that take the same way through the kd-tree
+// next to each other in the packets.  Each ray is traced on its own
+// terms, so their order does not change the image.
+void Wavefront::spawn()
+{
+	const BoundingBox& bounds = raytracer->scene->bounds();
+	keys.resize(next.size());
+	for (size_t k = 0; k < next.size(); ++k)
+		keys[k] = std::make_pair(binKey(paths[next[k]].r, bounds), next[k]);
+	std::sort(keys.begin(), keys.end());
+	for (size_t k = 0; k < next.size(); ++k) next[k] = keys[k].second;
+}
+
+Wavefront::PathRay Wavefront::child(const ray& r, int depth)
+{
+	PathRay p;
+	p.r = r;
+	p.depth = depth;
+	p.reflected = p.refracted = -1;
+	return p;
+}
+
+// Adds what each hit reflects and transmits to its colour, as
+// RayTracer::shade() does; children come later in paths, so they are
+// complete by the time their parent is reached.
+void Wavefront::resolve()
+{
+	for (int k = paths.size() - 1; k >= 0; --k) {
+		PathRay& p = paths[k];
+		if (!p.hasHit || (p.reflected < 0 && p.refracted < 0)) continue;
+		if (p.reflected >= 0) p.color += p.kr % paths[p.reflected].color;
+		if (p.refracted >= 0) p.color += p.kt % paths[p.refracted].color;
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+// A breadth-first alternative to RayTracer::traceRay() for a whole tile.
+// Instead of following each camera ray down its tree of reflections and
+// refractions before starting the next, a Wavefront takes every ray of a
+// generation through one stage at a time:
+//
+//   generate   the camera rays of every sample in the tile
+//   intersect  the queue, in packets of neighbouring rays
+//   shadow     the rays from every hit to each light, again in packets
+//   shade      the hits, grouped by object, and the rays they reflect
+//              and refract: the next generation
+//   spawn      that generation sorted by direction and origin
+//
+// until no rays are left, and then adds each ray's colour into its
+// parent's, deepest generation first.  Each stage runs the same small set
+// of code and data over many rays, rather than all of it over one.
+//
+// The arithmetic is that of traceRay(), term for term and in the same
+// order, so the image is identical.
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "scene/ray.h"
+#include "vecmath/vec.h"
+
+class RayTracer;
+
+class Wavefront {
+public:
+	explicit Wavefront(RayTracer* tracer) : raytracer(tracer) {}
+
+	// tracePixel() for every pixel of [x0,x1) x [y0,y1).  Once stop is
+	// set the tile is dropped between generations, its pixels untouched.
+	void traceTile(int x0, int y0, int x1, int y1, const std::atomic<bool>* stop = NULL);
+
+private:
+	// One ray of the tile.  A ray spawns its children in a later
+	// generation, so they always come after it in paths.
+	struct PathRay {
+		ray r;
+		int depth;	// as for traceRay()
+		isect hit;
+		bool hasHit;
+		Vec3d color;	// its own shading, then with its children's added
+		int reflected, refracted;	// the children, or -1
+		Vec3d kr, kt;	// the hit's material's weights for them
+	};
+
+	void generate(int x0, int y0, int x1, int y1);
+	void intersect();
+	void shadow();
+	void shade();
+	void spawn();
+	void resolve();
+	static PathRay child(const ray& r, int depth);
+
+	RayTracer* raytracer;
+
+	// Kept from tile to tile, so a render thread allocates them once.
+	std::vector<PathRay> paths;
+	std::vector<int> queue;		// the generation being traced
+	std::vector<int> hits;		// those of queue that hit something
+	std::vector<int> next;		// the generation they spawn
+	std::vector<std::pair<unsigned long long, int> > keys;	// for sorting next
+	std::vector<Vec3d> shadows;	// for hits[k], light l: k * lights + l
+	std::vector<int> order;		// of hits, for shading
+	std::vector<int> owner;		// pixel of each camera ray, in the tile
+	std::vector<Vec3d> sums;
+};
+
+#endif // __WAVEFRONT_H__
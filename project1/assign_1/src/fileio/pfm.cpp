@@ -0,0 +1,72 @@
+//
+// pfm.cpp
+//
+// Reading and writing portable float maps.  The header is "PF", the size,
+// and a scale whose sign gives the byte order of the floats: negative for
+// little endian.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pfm.h"
+
+static bool littleEndian()
+{
+	unsigned int one = 1;
+	return *(unsigned char*)&one == 1;
+}
+
+static void swapBytes(float *data, int n)
+{
+	unsigned char *p = (unsigned char*)data;
+	for ( int k = 0; k < n; ++k, p += 4 )
+	{
+		unsigned char t = p[0]; p[0] = p[3]; p[3] = t;
+		t = p[1]; p[1] = p[2]; p[2] = t;
+	}
+}
+
+float *readPFM(const char *fname, int& width, int& height)
+{
+	FILE *file = fopen(fname, "rb");
+	if ( !file )
+		return NULL;
+
+	char magic[3] = { 0, 0, 0 };
+	double scale;
+	// exactly one whitespace character separates the header from the data
+	if ( fscanf(file, "%2s %d %d %lf", magic, &width, &height, &scale) != 4 ||
+	     strcmp(magic, "PF") || width <= 0 || height <= 0 || scale == 0 ||
+	     fgetc(file) == EOF )
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	int n = width * height * 3;
+	float *data = new float [n];
+	bool ok = fread(data, sizeof(float), n, file) == (size_t)n;
+	fclose(file);
+	if ( !ok )
+	{
+		delete [] data;
+		return NULL;
+	}
+
+	if ( (scale < 0) != littleEndian() )
+		swapBytes(data, n);
+	return data;
+}
+
+bool writePFM(const char *fname, int width, int height, const float *data)
+{
+	FILE *file = fopen(fname, "wb");
+	if ( !file )
+		return false;
+
+	fprintf(file, "PF\n%d %d\n%s\n", width, height, littleEndian() ? "-1.0" : "1.0");
+	size_t n = size_t(width) * height * 3;
+	bool ok = fwrite(data, sizeof(float), n, file) == n;
+	return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,18 @@
+//
+// pfm.h
+//
+// Portable float maps: uncompressed 32-bit float RGB, for keeping the
+// linear framebuffer of a render rather than its tone mapped 8-bit view.
+// Rows run bottom to top, as in the framebuffer and in BMP files.
+//
+
+#ifndef PFM_H
+#define PFM_H
+
+// w*h*3 floats, allocated with new[]; NULL if the file is missing or not
+// a colour PFM.
+extern float *readPFM(const char *fname, int& width, int& height);
+// false if the file could not be written
+extern bool writePFM(const char *fname, int width, int height, const float *data);
+
+#endif
@@ -552,6 +552,11 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
 
   bool generateNormals( false );
   list<Vec3d> faces;
+  // A named trimesh can be placed again by later ones that say
+  // "instance = name;", which can give themselves a material and
+  // nothing else.  A name defined twice refers to the later mesh.
+  string name, instance;
+  bool hasMaterial( false ), hasGeometry( false );
 
   char* error;
   for( ;; )
@@ -564,17 +569,24 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( GENNORMALS );
         _tokenizer.Read( SEMICOLON );
         generateNormals = true;
+        hasGeometry = true;
         break;
 
       case MATERIAL:
         tmesh->setMaterial( parseMaterialExpression( scene, mat ) );
+        hasMaterial = true;
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
+         break;
+
+      case INSTANCE:
+         instance = parseIdentExpression();
          break;
 
       case MATERIALS:
+        hasGeometry = true;
         _tokenizer.Read( MATERIALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -595,6 +607,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NORMALS:
+        hasGeometry = true;
         _tokenizer.Read( NORMALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -615,6 +628,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case FACES:
+        hasGeometry = true;
         _tokenizer.Read( FACES );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -635,6 +649,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case POLYPOINTS:
+        hasGeometry = true;
         _tokenizer.Read( POLYPOINTS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -659,6 +674,27 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
       {
         _tokenizer.Read( RBRACE );
 
+        if( !instance.empty() )
+        {
+          meshmap::const_iterator source = meshes.find( instance );
+          if( source == meshes.end() )
+          {
+            ostringstream oss;
+            oss << "Instance of undefined trimesh '" << instance << "'.";
+            throw SyntaxErrorException( oss.str(), _tokenizer );
+          }
+          if( hasGeometry )
+          {
+            ostringstream oss;
+            oss << "Instance of trimesh '" << instance << "' has geometry of its own.";
+            throw SyntaxErrorException( oss.str(), _tokenizer );
+          }
+          scene->add( new TrimeshInstance( scene, new Material( tmesh->getMaterial() ),
+                                           transform, source->second, hasMaterial ) );
+          delete tmesh;
+          return;
+        }
+
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
         for( list<Vec3d>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
@@ -678,6 +714,8 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
 
+        if( !name.empty() )
+          meshes[ name ] = tmesh;
         scene->add( tmesh );
         return;
       }
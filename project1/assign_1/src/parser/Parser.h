@@ -23,6 +23,7 @@
 #include "../vecmath/mat.h"
 
 typedef std::map<string,Material> mmap;
+typedef std::map<string,Trimesh*> meshmap;
 
 /*
   class Parser:
@@ -105,6 +106,7 @@ private:
   private:
     Tokenizer& _tokenizer;
     mmap materials;
+    meshmap meshes;   // the named trimeshes, for instancing
     std::string _basePath;
 };
 
@@ -72,6 +72,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ NORMALS ]           = "normals";
     tokenNames[ MATERIALS ]         = "materials";
     tokenNames[ FACES ]             = "faces";
+    tokenNames[ INSTANCE ]          = "instance";
     tokenNames[ TRANSLATE ]         = "translate";
     tokenNames[ SCALE ]             = "scale";
     tokenNames[ ROTATE ]            = "rotate";
@@ -137,6 +138,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["gennormals"] = GENNORMALS;
     reservedWords["height"] = HEIGHT;
     reservedWords["index"] = INDEX;
+    reservedWords["instance"] = INSTANCE;
     reservedWords["linear_attenuation_coeff"] = LINEAR_ATTENUATION_COEFF;
     reservedWords["material"] = MATERIAL;
     reservedWords["materials"] = MATERIALS;
@@ -70,7 +70,7 @@ enum SYMBOL {
 
   POLYPOINTS, NORMALS,			// keywords affecting polygons
   MATERIALS, FACES,
-  GENNORMALS,
+  GENNORMALS, INSTANCE,
 
   TRANSLATE, SCALE,			// Transforms
   ROTATE, TRANSFORM,
@@ -58,43 +58,23 @@ public:
 	// if the ray hits the box, put the "t" value of the intersection
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
-	// Using Kay/Kajiya algorithm.
-	bool intersect(const ray& r, double& tMin, double& tMax) const {
-		Vec3d R0 = r.getPosition();
-		Vec3d Rd = r.getDirection();
+	// Using Kay/Kajiya algorithm, on a ray set up once for all the boxes
+	// it meets, and without branches: the ray's signs pick each slab's
+	// near and far planes, so there is nothing to swap.  A ray parallel
+	// to a slab gets t = -inf and +inf from it when it starts inside, and
+	// an empty interval when it starts outside.  Starting on one of the
+	// planes gives 0 * inf = NaN, which the comparisons below pass over,
+	// leaving that plane out.
+	bool intersect(const SlabRay& r, double& tMin, double& tMax) const {
 		tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 		tMax = 1.0e308;
-		double ttemp;
-	
-		for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-			double vd = Rd[currentaxis];
-			// if the ray is parallel to the face's plane (=0.0)
-			if( vd == 0.0 ) continue;
-			double v1 = bmin[currentaxis] - R0[currentaxis];
-			double v2 = bmax[currentaxis] - R0[currentaxis];
-			// two slab intersections
-			double t1 = v1/vd;
-			double t2 = v2/vd;
-			if ( t1 > t2 ) { // swap t1 & t2
-				ttemp = t1;
-				t1 = t2;
-				t2 = ttemp;
-			}
-			if (t1 > tMin) tMin = t1;
-			if (t2 < tMax) tMax = t2;
-			if (tMin > tMax) return false; // box is missed
-			if (tMax < RAY_EPSILON) return false; // box is behind ray
+		for (int a = 0; a < 3; a++) {
+			double tNear = ((r.sign[a] ? bmax : bmin)[a] - r.p[a]) * r.inv[a];
+			double tFar = ((r.sign[a] ? bmin : bmax)[a] - r.p[a]) * r.inv[a];
+			tMin = tNear > tMin ? tNear : tMin;
+			tMax = tFar < tMax ? tFar : tMax;
 		}
-		 return true; // it made it past all 3 axes.
-	}
-
-	void operator=(const BoundingBox& target) {
-		bmin = target.bmin;
-		bmax = target.bmax;
-		bArea = target.bArea;
-		bVolume = target.bVolume;
-		dirty = target.dirty;
-		bEmpty = target.bEmpty;
+		return tMin <= tMax && tMax >= RAY_EPSILON;
 	}
 
 	double area() {
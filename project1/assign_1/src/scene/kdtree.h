@@ -0,0 +1,593 @@
+//
+// kdtree.h
+//
+// The acceleration structure shared by the Scene (over its Geometry) and by
+// each Trimesh (over its faces).  Despite the name it is a bounding volume
+// hierarchy: every node stores the box around its objects and each object
+// is referenced by exactly one leaf (the midpoint split may still duplicate
+// objects when it cannot separate them).
+//
+// The tree is stored flattened: one array of 32-byte nodes in depth-first
+// order (an inner node's left child directly follows it) and one array of
+// object pointers that the leaves index into.
+//
+// Rays can also walk a tree in packets (see raypacket.h).
+//
+// Large trees are built in parallel: above KD_PARALLEL_MIN_OBJECTS the right
+// subtree is forked onto the shared ThreadPool into arrays of its own, and
+// spliced in after the left subtree is done.
+//
+
+#ifndef __KDTREE_H__
+#define __KDTREE_H__
+
+#include <vector>
+#include <iostream>
+#include <cmath>
+#include <chrono>
+
+#include "ray.h"
+#include "raypacket.h"
+#include "bbox.h"
+#include "threadpool.h"
+#include "renderstats.h"
+
+// Build parameters.  The SAH costs are relative to one object intersection.
+const int KD_MAX_DEPTH = 64;
+const int KD_MIDPOINT_MAX_DEPTH = 10;
+const int KD_MIDPOINT_LEAF_SIZE = 15;
+const int KD_SAH_BINS = 16;
+const int KD_SAH_MAX_LEAF_SIZE = 8;
+const double KD_SAH_TRAVERSAL_COST = 0.125;
+
+// Subtrees with fewer objects than this are built on the calling thread.
+const int KD_PARALLEL_MIN_OBJECTS = 4096;
+
+// Traversal pushes at most one deferred child per level.
+const int KD_STACK_SIZE = 2 * KD_MAX_DEPTH + 2;
+
+// A packet goes on ray by ray once no more than this fraction of its rays
+// are left in a subtree: there is no sharing left to pay for the
+// wider tests.
+const int KD_PACKET_SPLIT_FRACTION = 4;
+
+// One node of the flattened tree.  Bounds are single precision, rounded
+// outward so the box never shrinks.
+struct KdNode {
+  float bmin[3];
+  float bmax[3];
+  int offset;             // leaf: first object; inner: right child
+  unsigned int count : 30;  // leaf: number of objects; 0 for inner nodes
+  unsigned int axis : 2;    // inner: split axis
+
+  bool isLeaf() const { return count > 0; }
+
+  void setBounds(const BoundingBox& b) {
+    Vec3d lo = b.getMin(), hi = b.getMax();
+    for(int a = 0; a < 3; ++a) {
+      bmin[a] = float(lo[a]);
+      if(bmin[a] > lo[a]) bmin[a] = nextafterf(bmin[a], -HUGE_VALF);
+      bmax[a] = float(hi[a]);
+      if(bmax[a] < hi[a]) bmax[a] = nextafterf(bmax[a], HUGE_VALF);
+    }
+  }
+
+  // The branchless slab test of BoundingBox::intersect, on these bounds.
+  bool intersect(const SlabRay& r, double& tMin) const {
+    double tmin = -1.0e308;
+    double tmax = 1.0e308;
+    for(int a = 0; a < 3; ++a) {
+      double tNear = ((r.sign[a] ? bmax : bmin)[a] - r.p[a]) * r.inv[a];
+      double tFar = ((r.sign[a] ? bmin : bmax)[a] - r.p[a]) * r.inv[a];
+      tmin = tNear > tmin ? tNear : tmin;
+      tmax = tFar < tmax ? tFar : tmax;
+    }
+    tMin = tmin;
+    return tmin <= tmax && tmax >= RAY_EPSILON;
+  }
+};
+
+static_assert(sizeof(KdNode) == 32, "KdNode should stay 32 bytes");
+
+// Node and leaf counts, filled in by KdTree::collectStats().
+struct KdTreeStats {
+  KdTreeStats() : trees(0), objects(0), nodes(0), leaves(0), emptyLeaves(0),
+                  maxDepth(0), maxLeafSize(0), objectRefs(0), bytes(0),
+                  buildSeconds(0.0) {}
+
+  void add(const KdTreeStats& s) {
+    trees += s.trees;
+    objects += s.objects;
+    nodes += s.nodes;
+    leaves += s.leaves;
+    emptyLeaves += s.emptyLeaves;
+    objectRefs += s.objectRefs;
+    bytes += s.bytes;
+    buildSeconds += s.buildSeconds;
+    if(s.maxDepth > maxDepth) maxDepth = s.maxDepth;
+    if(s.maxLeafSize > maxLeafSize) maxLeafSize = s.maxLeafSize;
+  }
+
+  int trees;
+  long objects;
+  long nodes;
+  long leaves;
+  long emptyLeaves;
+  int maxDepth;
+  int maxLeafSize;
+  long objectRefs;    // sum of leaf sizes; larger than the object count
+                      // when a split duplicated objects into both children
+  long bytes;         // node and object arrays
+  double buildSeconds;  // wall clock
+};
+
+inline std::ostream& operator <<(std::ostream& os, const KdTreeStats& s) {
+  double avgLeaf = s.leaves > s.emptyLeaves ?
+    double(s.objectRefs) / double(s.leaves - s.emptyLeaves) : 0.0;
+  return os << s.trees << " tree(s), " << s.objects << " objects, " << s.nodes << " nodes, " << s.leaves
+            << " leaves (" << s.emptyLeaves << " empty), max depth " << s.maxDepth
+            << ", " << s.objectRefs << " object refs, avg/max leaf "
+            << avgLeaf << "/" << s.maxLeafSize << ", " << s.bytes / 1024 << " KB, built in "
+            << s.buildSeconds << " s";
+}
+
+// Surface area of a box; BoundingBox::area() caches and so is not const.
+inline double kdBoxArea(const BoundingBox& b) {
+  Vec3d d = b.getMax() - b.getMin();
+  return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+template<class T>
+class KdTree {
+public:
+  std::vector<KdNode> nodes;
+  std::vector<T*> prims;
+
+  // leafWidth: how many objects the owner tests at the cost of one, when
+  // it intersects leaves itself (see closestHit()); guides the SAH.
+  KdTree(std::vector<T*>& o, KdSplitMethod split = KD_SPLIT_SAH, int leafWidth = 1)
+    : objects(o.size()), buildSeconds(0.0) {
+    if(o.size() == 0) return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    nodes.reserve(2 * o.size());
+    prims.reserve(o.size());
+    std::vector<T*> work(o);
+    build(work, 0, split, leafWidth, nodes, prims);
+    nodes.shrink_to_fit();
+    prims.shrink_to_fit();
+    buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Closest hit; see closestHitFrom() for the walk.  sr is r set up for
+  // the slab tests, of the nodes and of the objects' own boxes alike.
+  void intersect(ray& r, const SlabRay& sr, isect& i, bool& have_one) const {
+    double tMax = have_one ? i.t : 1.0e308;
+    isect cur;
+    closestHit(sr, tMax, [&](int first, int count, double& t) {
+      for(int j = first; j < first + count; ++j) {
+        if(prims[j]->intersect(r, sr, cur)) {
+          if(!have_one || (cur.t < i.t)) {
+            i = cur;
+            have_one = true;
+            t = cur.t;
+          }
+        }
+      }
+    });
+  }
+
+  // Any hit closer than tmax, for shadow rays; see Scene::occluded().
+  bool occluded(ray& r, const SlabRay& sr, double tmax, bool& translucent) const {
+    return anyHit(sr, tmax, [&](int first, int count) {
+      for(int j = first; j < first + count; ++j) {
+        if(prims[j]->occluded(r, sr, tmax, translucent)) return true;
+      }
+      return false;
+    });
+  }
+
+  // Packet versions of intersect() and occluded(), for the rays of mask,
+  // with slabs set up from pk.  Each ray gets the result it would on its
+  // own, kept in the packet.
+  void intersect(RayPacket& pk, const PacketSlabs& slabs, int mask) const {
+    closestHitPacket(pk, slabs, pk.tMax, mask, [&](int first, int count, int live) {
+      for(int j = first; j < first + count; ++j) prims[j]->intersectPacket(pk, slabs, live);
+    });
+  }
+
+  void occluded(RayPacket& pk, const PacketSlabs& slabs, int mask) const {
+    pk.occluded |= anyHitPacket(pk, slabs, pk.tMax, mask, [&](int first, int count, int live) {
+      int hit = 0;
+      for(int j = first; j < first + count && live & ~hit; ++j)
+        hit |= prims[j]->occludedPacket(pk, slabs, live & ~hit);
+      return hit;
+    });
+  }
+
+  // The traversals behind intersect() and occluded(), for owners that keep
+  // their own per-leaf data (Trimesh's packed triangles).  The leaf
+  // functor gets the leaf's range in prims.  For closestHit it is
+  // leaf(first, count, tMax) and lowers tMax when it finds a closer hit;
+  // for anyHit it is leaf(first, count) and returns true to stop.
+  template<class Leaf>
+  void closestHit(const SlabRay& r, double& tMax, Leaf leaf) const {
+    if(!nodes.empty()) closestHitFrom(0, r, tMax, leaf);
+  }
+
+  template<class Leaf>
+  bool anyHit(const SlabRay& r, double tmax, Leaf leaf) const {
+    return !nodes.empty() && anyHitFrom(0, r, tmax, leaf);
+  }
+
+  // The same for the rays of mask in pk, set up in slabs, with tMax[k]
+  // for ray k.  Each node's box is tested against the packet's live rays
+  // at once, and the leaf functor gets the rays that reached the leaf as a mask: for
+  // closestHitPacket it is leaf(first, count, live) and lowers tMax[k]
+  // for the rays it finds closer hits for; for anyHitPacket it is
+  // leaf(first, count, live) and returns the rays it found blocked, which
+  // anyHitPacket returns in the end.  Rays left on their own in a subtree
+  // finish it alone, so leaves may also see single ray masks.
+  template<class Leaf>
+  void closestHitPacket(const RayPacket& pk, const PacketSlabs& slabs, double* tMax, int mask,
+                        Leaf leaf) const {
+    if(nodes.empty() || !mask) return;
+    int stack[KD_STACK_SIZE];
+    int live[KD_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    live[top++] = mask;
+
+    long long visits = 0;
+    while(top > 0) {
+      --top;
+      int n = stack[top];
+      const KdNode& node = nodes[n];
+      int m = slabs.hits(node.bmin, node.bmax, live[top], tMax);
+      if(!m) continue;
+
+      if(packetCount(m) * KD_PACKET_SPLIT_FRACTION <= pk.size) {
+        for(int k = 0; k < pk.size; ++k) {
+          if(!(m & (1 << k))) continue;
+          closestHitFrom(n, slabs.slabRay(k), tMax[k], [&](int first, int count, double&) {
+            leaf(first, count, 1 << k);
+          });
+        }
+        continue;
+      }
+
+      ++visits;
+      if(!node.isLeaf()) {
+        // near child last, so it is popped first; the first live ray
+        // decides which is near
+        int k = 0;
+        while(!(m & (1 << k))) ++k;
+        bool leftFirst = pk.rays[k].d[node.axis] >= 0.0;
+        stack[top] = leftFirst ? node.offset : n + 1;
+        live[top++] = m;
+        stack[top] = leftFirst ? n + 1 : node.offset;
+        live[top++] = m;
+      } else {
+        leaf(node.offset, int(node.count), m);
+      }
+    }
+    renderCounters.nodeVisits += visits;
+  }
+
+  template<class Leaf>
+  int anyHitPacket(const RayPacket& pk, const PacketSlabs& slabs, const double* tMax, int mask,
+                   Leaf leaf) const {
+    if(nodes.empty() || !mask) return 0;
+    int stack[KD_STACK_SIZE];
+    int live[KD_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    live[top++] = mask;
+
+    long long visits = 0;
+    int blocked = 0;
+    while(top > 0 && blocked != mask) {
+      --top;
+      int n = stack[top];
+      const KdNode& node = nodes[n];
+      int m = slabs.hits(node.bmin, node.bmax, live[top] & ~blocked, tMax);
+      if(!m) continue;
+
+      if(packetCount(m) * KD_PACKET_SPLIT_FRACTION <= pk.size) {
+        for(int k = 0; k < pk.size; ++k) {
+          if(!(m & (1 << k))) continue;
+          if(anyHitFrom(n, slabs.slabRay(k), tMax[k], [&](int first, int count) {
+               return leaf(first, count, 1 << k) != 0;
+             }))
+            blocked |= 1 << k;
+        }
+        continue;
+      }
+
+      ++visits;
+      if(!node.isLeaf()) {
+        stack[top] = node.offset;
+        live[top++] = m;
+        stack[top] = n + 1;
+        live[top++] = m;
+      } else {
+        blocked |= leaf(node.offset, int(node.count), m);
+      }
+    }
+    renderCounters.nodeVisits += visits;
+    return blocked;
+  }
+
+  void collectStats(KdTreeStats& s) const {
+    ++s.trees;
+    s.objects += objects;
+    s.buildSeconds += buildSeconds;
+    s.bytes += nodes.capacity() * sizeof(KdNode) + prims.capacity() * sizeof(T*);
+    if(nodes.empty()) {
+      ++s.nodes;
+      ++s.leaves;
+      ++s.emptyLeaves;
+      return;
+    }
+    collectStats(s, 0, 0);
+  }
+
+private:
+  long objects;
+  double buildSeconds;
+
+  // Closest hit from node root down.  Walks the tree with an explicit
+  // stack, descending into the child whose box the ray enters first and
+  // skipping any node whose box is entered beyond the closest hit found
+  // so far.
+  template<class Leaf>
+  void closestHitFrom(int root, const SlabRay& sr, double& tMax, Leaf leaf) const {
+    double tmin;
+    if(!nodes[root].intersect(sr, tmin)) return;
+
+    int stack[KD_STACK_SIZE];
+    double entry[KD_STACK_SIZE];
+    int top = 0;
+    stack[top] = root;
+    entry[top++] = tmin;
+
+    long long visits = 0;
+    while(top > 0) {
+      --top;
+      const KdNode& node = nodes[stack[top]];
+      if(entry[top] > tMax) continue;
+      ++visits;
+
+      if(!node.isLeaf()) {
+        int left = stack[top] + 1;
+        int right = node.offset;
+        double lmin = 0.0, rmin = 0.0;
+        bool hitLeft = nodes[left].intersect(sr, lmin);
+        bool hitRight = nodes[right].intersect(sr, rmin);
+        if(hitLeft && hitRight) {
+          // push the far child first so the near one is popped next
+          bool leftFirst = lmin <= rmin;
+          stack[top] = leftFirst ? right : left;
+          entry[top++] = leftFirst ? rmin : lmin;
+          stack[top] = leftFirst ? left : right;
+          entry[top++] = leftFirst ? lmin : rmin;
+        } else if(hitLeft) {
+          stack[top] = left;
+          entry[top++] = lmin;
+        } else if(hitRight) {
+          stack[top] = right;
+          entry[top++] = rmin;
+        }
+      } else {
+        leaf(node.offset, int(node.count), tMax);
+      }
+    }
+    renderCounters.nodeVisits += visits;
+  }
+
+  // Any hit from node root down.  Child order doesn't matter here, so
+  // there is no sorting.
+  template<class Leaf>
+  bool anyHitFrom(int root, const SlabRay& sr, double tmax, Leaf leaf) const {
+    double tmin;
+    if(!nodes[root].intersect(sr, tmin) || tmin > tmax) return false;
+
+    int stack[KD_STACK_SIZE];
+    int top = 0;
+    stack[top++] = root;
+    long long visits = 0;
+    bool hit = false;
+    while(top > 0 && !hit) {
+      int n = stack[--top];
+      const KdNode& node = nodes[n];
+      ++visits;
+      if(!node.isLeaf()) {
+        if(nodes[node.offset].intersect(sr, tmin) && tmin <= tmax) stack[top++] = node.offset;
+        if(nodes[n + 1].intersect(sr, tmin) && tmin <= tmax) stack[top++] = n + 1;
+      } else {
+        hit = leaf(node.offset, int(node.count));
+      }
+    }
+    renderCounters.nodeVisits += visits;
+    return hit;
+  }
+
+  void collectStats(KdTreeStats& s, int n, int depth) const {
+    const KdNode& node = nodes[n];
+    ++s.nodes;
+    if(depth > s.maxDepth) s.maxDepth = depth;
+    if(node.isLeaf()) {
+      ++s.leaves;
+      if(int(node.count) > s.maxLeafSize) s.maxLeafSize = node.count;
+      s.objectRefs += node.count;
+      return;
+    }
+    collectStats(s, n + 1, depth + 1);
+    collectStats(s, node.offset, depth + 1);
+  }
+
+  // Appends the subtree over o to nodes/prims; returns its index.
+  static int build(std::vector<T*>& o, int depth, KdSplitMethod split, int width,
+                   std::vector<KdNode>& nodes, std::vector<T*>& prims) {
+    int n = nodes.size();
+    nodes.push_back(KdNode());
+
+    BoundingBox bb = o[0]->getBoundingBox();
+    for(size_t i = 1; i < o.size(); ++i) {
+      bb.merge(o[i]->getBoundingBox());
+    }
+    nodes[n].setBounds(bb);
+
+    std::vector<T*> leftObj, rightObj;
+    int axis = split == KD_SPLIT_SAH ?
+      splitSAH(o, bb, depth, width, leftObj, rightObj) :
+      splitMidpoint(o, bb, depth, leftObj, rightObj);
+    if(axis < 0) {
+      nodes[n].offset = prims.size();
+      nodes[n].count = o.size();
+      nodes[n].axis = 0;
+      prims.insert(prims.end(), o.begin(), o.end());
+      return n;
+    }
+
+    std::vector<T*>().swap(o);
+    int right;
+    if(rightObj.size() >= KD_PARALLEL_MIN_OBJECTS && ThreadPool::shared().size() > 1) {
+      std::vector<KdNode> rightNodes;
+      std::vector<T*> rightPrims;
+      TaskGroup g;
+      g.run([&] { build(rightObj, depth + 1, split, width, rightNodes, rightPrims); });
+      build(leftObj, depth + 1, split, width, nodes, prims);
+      g.wait();
+      right = append(rightNodes, rightPrims, nodes, prims);
+    } else {
+      build(leftObj, depth + 1, split, width, nodes, prims);
+      right = build(rightObj, depth + 1, split, width, nodes, prims);
+    }
+    nodes[n].offset = right;
+    nodes[n].count = 0;
+    nodes[n].axis = axis;
+    return n;
+  }
+
+  // Splices a separately built subtree onto the end of nodes/prims,
+  // rebasing its indices; returns its root's new index.
+  static int append(const std::vector<KdNode>& subNodes, const std::vector<T*>& subPrims,
+                    std::vector<KdNode>& nodes, std::vector<T*>& prims) {
+    int nodeBase = nodes.size();
+    int primBase = prims.size();
+    for(size_t i = 0; i < subNodes.size(); ++i) {
+      KdNode node = subNodes[i];
+      node.offset += node.isLeaf() ? primBase : nodeBase;
+      nodes.push_back(node);
+    }
+    prims.insert(prims.end(), subPrims.begin(), subPrims.end());
+    return nodeBase;
+  }
+
+  // The original split: halve the longest axis of the node's box.
+  // Returns the axis, or -1 to make a leaf.
+  static int splitMidpoint(std::vector<T*>& o, BoundingBox& bb, int depth,
+                           std::vector<T*>& leftObj, std::vector<T*>& rightObj) {
+    if(o.size() <= KD_MIDPOINT_LEAF_SIZE || depth >= KD_MIDPOINT_MAX_DEPTH) return -1;
+
+    int axis = bb.getMaxAxis();
+    double maxCenter = bb.getCenter()[axis];
+    for(size_t i = 0; i < o.size(); ++i) {
+      if(o[i]->getBoundingBox().getCenter()[axis] < maxCenter) leftObj.push_back(o[i]);
+      else rightObj.push_back(o[i]);
+    }
+
+    if(leftObj.empty() && !rightObj.empty()) leftObj = rightObj;
+    if(!leftObj.empty() && rightObj.empty()) rightObj = leftObj;
+    return axis;
+  }
+
+  // Binned surface area heuristic: bucket the object centroids into
+  // KD_SAH_BINS slabs along each axis, and take the slab boundary that
+  // minimizes traversal cost + (area-weighted) intersection cost of the
+  // two children.  Stop when no split beats intersecting everything here.
+  static int splitSAH(std::vector<T*>& o, BoundingBox& bb, int depth, int width,
+                      std::vector<T*>& leftObj, std::vector<T*>& rightObj) {
+    int n = o.size();
+    if(n <= 2 || depth >= KD_MAX_DEPTH) return -1;
+
+    BoundingBox cb;
+    for(int i = 0; i < n; ++i) {
+      Vec3d c = o[i]->getBoundingBox().getCenter();
+      cb.merge(BoundingBox(c, c));
+    }
+
+    double area = kdBoxArea(bb);
+    double bestCost = 1.0e308;
+    int bestAxis = -1;
+    int bestBin = 0;
+    for(int a = 0; a < 3; ++a) {
+      double cmin = cb.getMin()[a];
+      double extent = cb.getMax()[a] - cmin;
+      if(extent <= 0.0) continue;
+
+      int count[KD_SAH_BINS] = { 0 };
+      BoundingBox bins[KD_SAH_BINS];
+      for(int i = 0; i < n; ++i) {
+        int b = binOf(o[i], a, cmin, extent);
+        ++count[b];
+        bins[b].merge(o[i]->getBoundingBox());
+      }
+
+      // rightArea[b] / rightCount[b] describe bins b..KD_SAH_BINS-1
+      double rightArea[KD_SAH_BINS];
+      int rightCount[KD_SAH_BINS];
+      BoundingBox acc;
+      int accCount = 0;
+      for(int b = KD_SAH_BINS - 1; b > 0; --b) {
+        acc.merge(bins[b]);
+        accCount += count[b];
+        rightArea[b] = kdBoxArea(acc);
+        rightCount[b] = accCount;
+      }
+
+      acc.setEmpty();
+      accCount = 0;
+      for(int b = 1; b < KD_SAH_BINS; ++b) {
+        acc.merge(bins[b - 1]);
+        accCount += count[b - 1];
+        if(accCount == 0 || rightCount[b] == 0) continue;
+        double cost = KD_SAH_TRAVERSAL_COST +
+          (kdBoxArea(acc) * blocks(accCount, width) +
+           rightArea[b] * blocks(rightCount[b], width)) / area;
+        if(cost < bestCost) {
+          bestCost = cost;
+          bestAxis = a;
+          bestBin = b;
+        }
+      }
+    }
+
+    if(bestAxis < 0 || (bestCost >= blocks(n, width) && n <= KD_SAH_MAX_LEAF_SIZE)) return -1;
+
+    double cmin = cb.getMin()[bestAxis];
+    double extent = cb.getMax()[bestAxis] - cmin;
+    for(int i = 0; i < n; ++i) {
+      if(binOf(o[i], bestAxis, cmin, extent) < bestBin) leftObj.push_back(o[i]);
+      else rightObj.push_back(o[i]);
+    }
+    return bestAxis;
+  }
+
+  // Intersection cost of n objects tested width at a time.
+  static int blocks(int n, int width) {
+    return (n + width - 1) / width;
+  }
+
+  static int binOf(const T* o, int a, double cmin, double extent) {
+    int b = int(KD_SAH_BINS * (o->getBoundingBox().getCenter()[a] - cmin) / extent);
+    if(b < 0) b = 0;
+    if(b >= KD_SAH_BINS) b = KD_SAH_BINS - 1;
+    return b;
+  }
+
+  KdTree(const KdTree<T>&);
+  KdTree<T>& operator =(const KdTree<T>&);
+};
+
+#endif // __KDTREE_H__
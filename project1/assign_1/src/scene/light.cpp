@@ -11,20 +11,31 @@ double DirectionalLight::distanceAttenuation(const Vec3d& P) const
 }
 
 
-Vec3d DirectionalLight::shadowAttenuation(const Scene* scene, const Vec3d& p) const
+Vec3d Light::translucentAttenuation(const Scene* scene, const Vec3d& p) const
 {
-  Vec3d d = getDirection(p);
+  ray lightRay = ray(p, getDirection(p), ray::SHADOW);
   isect i;
-  ray lightRay = ray(p, d);
-  if(scene->intersect(lightRay, i)) {
-    const Material& m = i.getMaterial();
-      //if(m.Trans()) return m.kt(i) / (m.kt(i) + m.kd(i));
-      //#TODO
-    if(m.Trans()) return m.kt(i);
-    return Vec3d(0, 0, 0);
+  if(scene->intersect(lightRay, i) && i.t < shadowDistance(p)) {
+    if(!i.isTranslucent()) return Vec3d(0, 0, 0);
+    MaterialScratch scratch;
+    const Material& m = i.getMaterial(scratch);
+    //return m.kt(i) / (m.kt(i) + m.kd(i));
+    return m.kt(i);
   } else return Vec3d(1, 1, 1);
 }
 
+Vec3d DirectionalLight::shadowAttenuation(const Scene* scene, const Vec3d& p) const
+{
+  Vec3d d = getDirection(p);
+  ray lightRay = ray(p, d, ray::SHADOW);
+  bool translucent = false;
+  if(scene->occluded(lightRay, 1.0e308, translucent)) return Vec3d(0, 0, 0);
+  if(!translucent) return Vec3d(1, 1, 1);
+
+  // Only transmissive objects are in the way; filter by the closest.
+  return translucentAttenuation(scene, p);
+}
+
 Vec3d DirectionalLight::getColor() const
 {
   return color;
@@ -63,18 +74,12 @@ Vec3d PointLight::getDirection(const Vec3d& P) const
 Vec3d PointLight::shadowAttenuation(const Scene* scene, const Vec3d& p) const
 {
   Vec3d d = getDirection(p);
-  isect i;
+  double distance = (position - p).length();
   ray lightRay = ray(p, d, ray::SHADOW);
-  if(scene->intersect(lightRay, i)) {
-    if(i.t < (position - p).length()) {
-      const Material& m = i.getMaterial();
-      //if(m.Trans()) return m.kt(i) / (m.kt(i) + m.kd(i));
-      //#TODO
-      //return Vec3d(0, 0, 0);
-      if(m.Trans()) return m.kt(i);
-      else return Vec3d(0, 0, 0);
-    } else {
-      return Vec3d(1, 1, 1);
-    }
-  } else return Vec3d(1, 1, 1);
+  bool translucent = false;
+  if(scene->occluded(lightRay, distance, translucent)) return Vec3d(0, 0, 0);
+  if(!translucent) return Vec3d(1, 1, 1);
+
+  // Only transmissive objects are in the way; filter by the closest.
+  return translucentAttenuation(scene, p);
 }
@@ -18,6 +18,12 @@ public:
 	virtual double distanceAttenuation(const Vec3d& P) const = 0;
 	virtual Vec3d getColor() const = 0;
 	virtual Vec3d getDirection (const Vec3d& P) const = 0;
+	// How far a shadow ray from P has to go to reach the light.
+	virtual double shadowDistance(const Vec3d& P) const = 0;
+
+	// The rest of shadowAttenuation() for a shadow ray from P that
+	// passes only through transmissive objects: filtered by the closest.
+	Vec3d translucentAttenuation(const Scene* scene, const Vec3d& P) const;
 
 protected:
 	Light(Scene *scene, const Vec3d& col) : SceneElement(scene), color(col) {}
@@ -39,6 +45,7 @@ public:
 	virtual double distanceAttenuation(const Vec3d& P) const;
 	virtual Vec3d getColor() const;
 	virtual Vec3d getDirection(const Vec3d& P) const;
+	virtual double shadowDistance(const Vec3d&) const { return 1.0e308; }
 
 protected:
 	Vec3d 		orientation;
@@ -65,6 +72,7 @@ public:
 	virtual double distanceAttenuation(const Vec3d& P) const;
 	virtual Vec3d getColor() const;
 	virtual Vec3d getDirection(const Vec3d& P) const;
+	virtual double shadowDistance(const Vec3d& P) const { return (position - P).length(); }
 
 	void setAttenuationConstants(float a, float b, float c)
 	{
@@ -16,17 +16,19 @@ Vec3d reflectDirectionM(const isect& i, const Light* l, const ray& r) {
     return (2.0 * (l->getDirection(r.at(i.t)) * i.N) * i.N - l->getDirection(r.at(i.t)));
 }
 
-Vec3d Material::shade(Scene *scene, const ray& r, const isect& i) const
+Vec3d Material::shade(Scene *scene, const ray& r, const isect& i, const Vec3d* shadows) const
 {
   Vec3d colorC = ke(i) + ka(i) % scene->ambient();
   Vec3d view = scene->getCamera().getEye() - r.at(i.t);
   view.normalize();
+  int l = 0;
   for ( vector<Light*>::const_iterator litr = scene->beginLights(); 
-    litr != scene->endLights(); ++litr ) {
+    litr != scene->endLights(); ++litr, ++l ) {
       Light* light = *litr;
       //if(i.N * light->getDirection(r.at(i.t)) < 0) continue;
       Vec3d lColor = light->getColor();
-      Vec3d atten = light->distanceAttenuation(r.at(i.t)) * light->shadowAttenuation(scene, r.at(i.t));
+      Vec3d shadow = shadows ? shadows[l] : light->shadowAttenuation(scene, r.at(i.t));
+      Vec3d atten = light->distanceAttenuation(r.at(i.t)) * shadow;
       Vec3d diffuseTerm = kd(i) * max(i.N * light->getDirection(r.at(i.t)), 0.0);
       Vec3d R = reflectDirectionM(i, light, r);
       R.normalize();
@@ -10,6 +10,7 @@
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 #include <string>
+#include <new>
 
 class Scene;
 class ray;
@@ -176,7 +177,9 @@ public:
         : _ke( e ), _ka( a ), _ks( s ), _kd( d ), _kr( r ), _kt( t ), 
           _shininess( Vec3d(sh,sh,sh) ), _index( Vec3d(in,in,in) ) { setBools(); }
 
-	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i ) const;
+	// shadows: the shadowAttenuation() of each light at the hit, if the
+	// caller has worked them out already (see RayTracer::tracePacket())
+	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i, const Vec3d* shadows = NULL ) const;
     
     Material &
     operator+=( const Material &m )
@@ -286,4 +289,28 @@ operator*( double d, Material m )
     return m;
 }
 
+// Room for a material worked out at a hit (see SceneObject::materialAt()).
+// It is only built if one is, so hits on objects with a single material
+// cost nothing more than the reference to it.
+class MaterialScratch
+{
+public:
+    MaterialScratch() : m( 0 ) {}
+    ~MaterialScratch() { if( m ) m->~Material(); }
+
+    Material& set( const Material& v )
+    {
+        if( m ) *m = v;
+        else m = new( space ) Material( v );
+        return *m;
+    }
+
+private:
+    MaterialScratch( const MaterialScratch& );
+    MaterialScratch& operator=( const MaterialScratch& );
+
+    Material* m;
+    alignas( Material ) unsigned char space[ sizeof( Material ) ];
+};
+
 #endif // __MATERIAL_H__
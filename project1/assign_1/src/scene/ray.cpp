@@ -1,9 +1,18 @@
 #include "ray.h"
 #include "material.h"
 #include "scene.h"
+#include "renderstats.h"
 
-const Material &
-isect::getMaterial() const
+thread_local RenderCounters renderCounters;
+
+const Material&
+isect::getMaterial(MaterialScratch& scratch) const
+{
+    return obj->materialAt(*this, scratch);
+}
+
+bool
+isect::isTranslucent() const
 {
-    return material ? *material : obj->getMaterial();
+    return obj->isTranslucentAt(*this);
 }
@@ -30,6 +30,7 @@ public:
 		SHADOW
 	};
 
+        ray() : t(VISIBILITY) {}
         ray(const Vec3d &pp, const Vec3d &dd, RayType tt = VISIBILITY)
 	  : p(pp), d(dd), t(tt) {}
         ray(const ray& other) : p(other.p), d(other.d), t(other.t) {}
@@ -51,53 +52,50 @@ public:
 	RayType t;
 };
 
+// A ray set up once for slab tests against many boxes: its reciprocal
+// direction, infinite along any axis it is parallel to, and the sign of
+// each component, which says which plane of a slab the ray meets first.
+struct SlabRay {
+	SlabRay() {}
+	explicit SlabRay(const ray& r) : p(r.p) {
+		for (int a = 0; a < 3; ++a) {
+			// The sign is taken from inv, not d: +0.0 gives +inf and
+			// sign 0, -0.0 gives -inf and sign 1.  Either way a ray
+			// parallel to a slab gets tNear = -inf and tFar = +inf when
+			// it starts between the planes, where testing d < 0 would
+			// give -0.0 sign 0 and swap them.
+			inv[a] = 1.0 / r.d[a];
+			sign[a] = inv[a] < 0.0;
+		}
+	}
+
+	Vec3d p;
+	Vec3d inv;
+	int sign[3];
+};
+
 // The description of an intersection point.
 
 class isect
 {
 public:
-    isect() : obj( NULL ), t( 0.0 ), N(), material(0) {}
-	isect(const isect& other)
-	{
-		obj = other.obj;
-		t = other.t;
-		N = other.N;
-		bary = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) material = new Material(*other.material);
-		else material = 0;
-	}
-
-	~isect() { delete material; }
-    
-    isect& operator = (const isect& other) {
-        if( this != &other ) {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-			bary = other.bary;
-            uvCoordinates = other.uvCoordinates;
-			if( other.material ) {
-                if( material ) *material = *other.material;
-                else material = new Material(*other.material );
-            }
-            else {
-                delete material;
-                material = 0;
-            }
-        }
-        return *this;
-    }
+    isect() : obj( NULL ), t( 0.0 ), N() {}
 
     void setObject(const SceneObject *o) { obj = o; }
     void setT(double tt) { t = tt; }
     void setN(const Vec3d& n) { N = n; }
-    void setMaterial(const Material& m)  { if(material) *material = m; else material = new Material(m); }
     void setUVCoordinates( const Vec2d& coords ) { uvCoordinates = coords; }
     void setBary(const Vec3d& weights) { bary = weights; }
     void setBary(const double alpha, const double beta, const double gamma)
 		{ bary[0] = alpha; bary[1] = beta; bary[2] = gamma; }
-    const Material &getMaterial() const;
+
+    // The material at the hit point (see SceneObject::materialAt()).  An
+    // interpolated one is built in scratch, so only hits that get shaded
+    // pay for it; keep scratch for as long as the result is used.
+    const Material& getMaterial(MaterialScratch& scratch) const;
+    // Whether the hit is on transmissive material, without working out
+    // the rest of it; for shadow rays.
+    bool isTranslucent() const;
 
 public:
     const SceneObject *obj;
@@ -105,9 +103,6 @@ public:
     Vec3d N;
     Vec2d uvCoordinates;
     Vec3d bary;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
 };
 
 const double RAY_EPSILON = 0.00000001;
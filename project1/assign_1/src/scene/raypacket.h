@@ -0,0 +1,201 @@
+//
+// raypacket.h
+//
+// Up to RAY_PACKET_MAX rays traced together: camera rays through a small
+// block of pixels, or the shadow rays from their hits towards one light.
+// Such rays take nearly the same path through the kd-trees, so the trees
+// walk a packet once and test each node's box against all of its rays
+// with SIMD slab tests (see KdTree::closestHitPacket()).
+//
+// The slab test is the branchless double precision one of
+// KdNode::intersect() and BoundingBox::intersect(), run two or four rays
+// wide, so every ray of a packet reaches the same objects it would on
+// its own and finds the same hit.
+//
+
+#ifndef __RAYPACKET_H__
+#define __RAYPACKET_H__
+
+#include <string.h>
+
+#include "ray.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 4x4, the largest packet the render threads form.
+const int RAY_PACKET_MAX = 16;
+
+// Bit k of a packet mask stands for ray k.
+inline int packetCount(int mask) {
+  int n = 0;
+  for(; mask; mask &= mask - 1) ++n;
+  return n;
+}
+
+struct RayPacket {
+  RayPacket() : size(0), hit(0), occluded(0), translucent(0) {}
+
+  // tmax: the shadow distance, for occluded()
+  void add(const ray& r, double tmax = 1.0e308) {
+    rays[size] = r;
+    tMax[size] = tmax;
+    ++size;
+  }
+
+  int all() const { return (1 << size) - 1; }
+
+  int size;
+  ray rays[RAY_PACKET_MAX];
+  // Scene::intersect() keeps each ray's closest hit here, with its
+  // distance in tMax; hit has the rays that have one.
+  isect hits[RAY_PACKET_MAX];
+  double tMax[RAY_PACKET_MAX];
+  int hit;
+  // set by Scene::occluded(), as for a single shadow ray
+  int occluded;
+  int translucent;
+};
+
+// A packet's rays as SlabRays in structure-of-arrays form for the slab
+// tests, padded to a whole number of SIMD registers.  Scene makes one
+// per packet and hands it down to every box the packet meets, until a
+// transform moves the rays.
+struct PacketSlabs {
+  PacketSlabs() : size(0) {}
+  explicit PacketSlabs(const RayPacket& pk) { set(pk); }
+
+  void set(const RayPacket& pk) {
+    size = pk.size;
+    for(int k = 0; k < RAY_PACKET_MAX; ++k) {
+      SlabRay r(k < pk.size ? pk.rays[k] : pk.rays[0]);
+      for(int a = 0; a < 3; ++a) {
+        p[a][k] = r.p[a];
+        inv[a][k] = r.inv[a];
+        // all ones for a negative direction, to select with
+        unsigned long long bits = r.sign[a] ? ~0ULL : 0ULL;
+        memcpy(&negative[a][k], &bits, sizeof(bits));
+      }
+    }
+  }
+
+  // The rays of mask whose slab test against the box passes and that
+  // enter it no further than tMax[k].  Bounds are float for kd-tree
+  // nodes and double for objects' boxes.
+  template<class T>
+  int hits(const T* bmin, const T* bmax, int mask, const double* tMax) const;
+
+  // Ray k on its own, without dividing again.
+  SlabRay slabRay(int k) const {
+    SlabRay r;
+    for(int a = 0; a < 3; ++a) {
+      r.p[a] = p[a][k];
+      r.inv[a] = inv[a][k];
+      r.sign[a] = inv[a][k] < 0.0;
+    }
+    return r;
+  }
+
+  int size;
+  double p[3][RAY_PACKET_MAX];
+  double inv[3][RAY_PACKET_MAX];
+  double negative[3][RAY_PACKET_MAX];
+};
+
+#if defined(__AVX__) || defined(__SSE2__)
+
+// Just enough of a double vector type to write the slab test once, in
+// the manner of TriLanes.  packetMin() and packetMax() give b wherever a
+// is NaN.
+#if defined(__AVX__)
+const int PACKET_LANES = 4;
+struct PacketLanes {
+  PacketLanes(__m256d x) : v(x) {}
+  __m256d v;
+};
+inline PacketLanes packetSet(double f) { return _mm256_set1_pd(f); }
+inline PacketLanes packetLoad(const double* p) { return _mm256_loadu_pd(p); }
+inline PacketLanes operator -(PacketLanes a, PacketLanes b) { return _mm256_sub_pd(a.v, b.v); }
+inline PacketLanes operator *(PacketLanes a, PacketLanes b) { return _mm256_mul_pd(a.v, b.v); }
+inline PacketLanes packetMin(PacketLanes a, PacketLanes b) { return _mm256_min_pd(a.v, b.v); }
+inline PacketLanes packetMax(PacketLanes a, PacketLanes b) { return _mm256_max_pd(a.v, b.v); }
+inline PacketLanes packetAnd(PacketLanes a, PacketLanes b) { return _mm256_and_pd(a.v, b.v); }
+// mask ? a : b
+inline PacketLanes packetSelect(PacketLanes mask, PacketLanes a, PacketLanes b) {
+  return _mm256_blendv_pd(b.v, a.v, mask.v);
+}
+inline PacketLanes packetLessEqual(PacketLanes a, PacketLanes b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+inline int packetMask(PacketLanes a) { return _mm256_movemask_pd(a.v); }
+#else
+const int PACKET_LANES = 2;
+struct PacketLanes {
+  PacketLanes(__m128d x) : v(x) {}
+  __m128d v;
+};
+inline PacketLanes packetSet(double f) { return _mm_set1_pd(f); }
+inline PacketLanes packetLoad(const double* p) { return _mm_loadu_pd(p); }
+inline PacketLanes operator -(PacketLanes a, PacketLanes b) { return _mm_sub_pd(a.v, b.v); }
+inline PacketLanes operator *(PacketLanes a, PacketLanes b) { return _mm_mul_pd(a.v, b.v); }
+inline PacketLanes packetMin(PacketLanes a, PacketLanes b) { return _mm_min_pd(a.v, b.v); }
+inline PacketLanes packetMax(PacketLanes a, PacketLanes b) { return _mm_max_pd(a.v, b.v); }
+inline PacketLanes packetAnd(PacketLanes a, PacketLanes b) { return _mm_and_pd(a.v, b.v); }
+inline PacketLanes packetSelect(PacketLanes mask, PacketLanes a, PacketLanes b) {
+  return _mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v));
+}
+inline PacketLanes packetLessEqual(PacketLanes a, PacketLanes b) { return _mm_cmple_pd(a.v, b.v); }
+inline int packetMask(PacketLanes a) { return _mm_movemask_pd(a.v); }
+#endif
+
+template<class T>
+inline int PacketSlabs::hits(const T* bmin, const T* bmax, int mask, const double* tMax) const {
+  const int laneMask = (1 << PACKET_LANES) - 1;
+  PacketLanes lowest = packetSet(-1.0e308), highest = packetSet(1.0e308);
+  int result = 0;
+  for(int c = 0; c < size; c += PACKET_LANES) {
+    if(!((mask >> c) & laneMask)) continue;
+    PacketLanes tmin = lowest, tmax = highest;
+    for(int a = 0; a < 3; ++a) {
+      PacketLanes o = packetLoad(p[a] + c), r = packetLoad(inv[a] + c);
+      PacketLanes t1 = (packetSet(bmin[a]) - o) * r;
+      PacketLanes t2 = (packetSet(bmax[a]) - o) * r;
+      // near and far planes by the ray's sign; a NaN from a parallel ray
+      // starting on a plane leaves the interval alone
+      PacketLanes negative = packetLoad(this->negative[a] + c);
+      tmin = packetMax(packetSelect(negative, t2, t1), tmin);
+      tmax = packetMin(packetSelect(negative, t1, t2), tmax);
+    }
+    PacketLanes in = packetAnd(packetLessEqual(tmin, tmax),
+                               packetLessEqual(packetSet(RAY_EPSILON), tmax));
+    in = packetAnd(in, packetLessEqual(tmin, packetLoad(tMax + c)));
+    result |= packetMask(in) << c;
+  }
+  return result & mask;
+}
+
+#else
+
+template<class T>
+inline int PacketSlabs::hits(const T* bmin, const T* bmax, int mask, const double* tMax) const {
+  int result = 0;
+  for(int k = 0; k < size; ++k) {
+    if(!(mask & (1 << k))) continue;
+    double tmin = -1.0e308, tmax = 1.0e308;
+    for(int a = 0; a < 3; ++a) {
+      double t1 = (bmin[a] - p[a][k]) * inv[a][k];
+      double t2 = (bmax[a] - p[a][k]) * inv[a][k];
+      bool negative = inv[a][k] < 0.0;
+      double tNear = negative ? t2 : t1, tFar = negative ? t1 : t2;
+      tmin = tNear > tmin ? tNear : tmin;
+      tmax = tFar < tmax ? tFar : tmax;
+    }
+    if(tmin <= tmax && tmax >= RAY_EPSILON && tmin <= tMax[k]) result |= 1 << k;
+  }
+  return result;
+}
+
+#endif
+
+#endif // __RAYPACKET_H__
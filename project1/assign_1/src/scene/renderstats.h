@@ -0,0 +1,39 @@
+//
+// renderstats.h
+//
+// Counters for what a render did.  Every thread counts into its own
+// thread_local copy, so there is no sharing on the hot paths; RenderJob
+// clears a render thread's copy when it starts and adds it to the job's
+// totals when it finishes.
+//
+
+#ifndef __RENDERSTATS_H__
+#define __RENDERSTATS_H__
+
+#include "ray.h"
+
+struct RenderCounters {
+  RenderCounters() { clear(); }
+
+  void clear() {
+    for(int t = 0; t < 4; ++t) rays[t] = 0;
+    nodeVisits = 0;
+    triangleTests = 0;
+  }
+
+  void add(const RenderCounters& c) {
+    for(int t = 0; t < 4; ++t) rays[t] += c.rays[t];
+    nodeVisits += c.nodeVisits;
+    triangleTests += c.triangleTests;
+  }
+
+  long long totalRays() const { return rays[0] + rays[1] + rays[2] + rays[3]; }
+
+  long long rays[4];        // indexed by ray::RayType
+  long long nodeVisits;     // kd-tree nodes popped during traversal
+  long long triangleTests;  // mesh faces tested, packed or not
+};
+
+extern thread_local RenderCounters renderCounters;
+
+#endif // __RENDERSTATS_H__
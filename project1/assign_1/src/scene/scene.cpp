@@ -2,34 +2,112 @@
 
 #include "scene.h"
 #include "light.h"
+#include "raypacket.h"
+#include "../vecmath/simd.h"
 #include "../ui/TraceUI.h"
 
 extern TraceUI* traceUI;
 using namespace std;
 
-bool Geometry::intersect(ray& r, isect& i) const {
+bool Geometry::intersect(ray& r, const SlabRay& sr, isect& i) const {
 	double tmin, tmax;
-	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
+	if (hasBoundingBoxCapability() && !(bounds.intersect(sr, tmin, tmax))) return false;
+	return intersectInBox(r, i);
+}
+
+bool Geometry::intersectInBox(ray& r, isect& i) const {
 	// Transform the ray into the object's local coordinate space
-	Vec3d pos = transform->globalToLocalCoords(r.p);
-	Vec3d dir = transform->globalToLocalCoords(r.p + r.d) - pos;
-	double length = dir.length();
-	dir /= length;
-	Vec3d Wpos = r.p;
-	Vec3d Wdir = r.d;
-	r.p = pos;
-	r.d = dir;
-	bool rtrn = false;
-	if (intersectLocal(r, i))
-	{
-		// Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
-		i.t /= length;
-		rtrn = true;
+	ray local;
+	double length = transform->rayToLocal(r, local);
+	if (!intersectLocal(local, i)) return false;
+	// Transform the intersection point & normal returned back into global space.
+	i.N = transform->localToGlobalCoordsNormal(i.N);
+	i.t /= length;
+	return true;
+}
+
+bool Geometry::occluded(ray& r, const SlabRay& sr, double tmax, bool& translucent) const {
+	double tmin, tmaxBox;
+	if (hasBoundingBoxCapability() && 
+		(!bounds.intersect(sr, tmin, tmaxBox) || tmin > tmax)) return false;
+	return occludedInBox(r, tmax, translucent);
+}
+
+bool Geometry::occludedInBox(ray& r, double tmax, bool& translucent) const {
+	// Same transformation as intersect(); tmax scales with the direction.
+	ray local;
+	double length = transform->rayToLocal(r, local);
+	return occludedLocal(local, tmax * length, translucent);
+}
+
+bool Geometry::occludedLocal(ray& r, double tmax, bool& translucent) const {
+	isect i;
+	if (!intersectLocal(r, i) || i.t >= tmax) return false;
+	if (i.isTranslucent()) {
+		translucent = true;
+		return false;
+	}
+	return true;
+}
+
+void TransformNode::packetToLocal(const RayPacket& pk, int mask, RayPacket& local, double* length) const {
+	if (kind <= TRANSFORM_TRANSLATION) {
+		for (int k = 0; k < pk.size; ++k)
+			if (mask & (1 << k)) length[k] = rayToLocal(pk.rays[k], local.rays[k]);
+		return;
+	}
+
+	Vec3d p[RAY_PACKET_MAX], d[RAY_PACKET_MAX];
+	int which[RAY_PACKET_MAX], n = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		p[n] = pk.rays[k].p;
+		d[n] = pk.rays[k].d;
+		which[n++] = k;
+	}
+	transformPoints(invLinear, invTranslation, p, p, n);
+	transformVectors(invLinear, d, d, n);
+	for (int j = 0; j < n; ++j) {
+		int k = which[j];
+		length[k] = kind == TRANSFORM_UNIFORM_SCALE ? lengthScale : d[j].length();
+		local.rays[k] = ray(p[j], d[j] / length[k], pk.rays[k].type());
 	}
-	r.p = Wpos;
-	r.d = Wdir;
-	return rtrn;
+}
+
+// The box test of the rays of mask, as occluded() and intersect() do it
+// ray by ray; a box entered past a ray's tMax has nothing closer.
+static int packetInBox(const Geometry& g, const PacketSlabs& slabs, int mask, const double* tMax) {
+	if (!g.hasBoundingBoxCapability()) return mask;
+	Vec3d lo = g.getBoundingBox().getMin(), hi = g.getBoundingBox().getMax();
+	return slabs.hits(&lo[0], &hi[0], mask, tMax);
+}
+
+int Geometry::intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const {
+	mask = packetInBox(*this, slabs, mask, pk.tMax);
+	int closer = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		isect cur;
+		if (intersectInBox(pk.rays[k], cur) && cur.t < pk.tMax[k]) {
+			pk.hits[k] = cur;
+			pk.tMax[k] = cur.t;
+			closer |= 1 << k;
+		}
+	}
+	pk.hit |= closer;
+	return closer;
+}
+
+int Geometry::occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const {
+	mask = packetInBox(*this, slabs, mask, pk.tMax);
+	int blocked = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		bool translucent = false;
+		if (occludedInBox(pk.rays[k], pk.tMax[k], translucent)) blocked |= 1 << k;
+		if (translucent) pk.translucent |= 1 << k;
+	}
+	return blocked;
 }
 
 bool Geometry::hasBoundingBoxCapability() const {
@@ -46,12 +124,32 @@ bool Geometry::hasBoundingBoxCapability() const {
 
 void Scene::buildKdTree() {
 	if(kdtree) delete kdtree;
+	kdSplit = traceUI->getKdSplit();
+	boundedobjects.clear();
+	nonboundedobjects.clear();
+	// Mesh trees are independent, so they are built concurrently; each
+	// build also forks its own large subtrees onto the same pool.
+	TaskGroup meshes;
 	for(int i = 0; i < objects.size(); ++i) {
 		if(objects[i]->isTrimesh()) {
-			objects[i]->buildKdTree();
+			Geometry* mesh = objects[i];
+			KdSplitMethod split = kdSplit;
+			meshes.run([mesh, split] { mesh->buildKdTree(split); });
 		}
+		// Objects without a box can't be placed in the tree; they are
+		// tested against every ray instead.
+		if(objects[i]->hasBoundingBoxCapability()) boundedobjects.push_back(objects[i]);
+		else nonboundedobjects.push_back(objects[i]);
+	}
+	meshes.wait();
+	kdtree = new KdTree<Geometry>(boundedobjects, kdSplit);
+}
+
+void Scene::collectKdTreeStats(KdTreeStats& sceneTree, KdTreeStats& meshTrees) const {
+	if(kdtree) kdtree->collectStats(sceneTree);
+	for(size_t i = 0; i < objects.size(); ++i) {
+		objects[i]->collectKdTreeStats(meshTrees);
 	}
-	kdtree = new KdTree<Geometry>(objects, 0);
 }
 
 Scene::~Scene() {
@@ -70,13 +168,24 @@ bool Scene::intersect(ray& r, isect& i) const {
 	double tmin = 0.0;
 	double tmax = 0.0;
 	bool have_one = false;
+	SlabRay sr(r);
 	if(kdtree && traceUI->useKdTree()) {
-		kdtree->intersect(r, i, have_one);
+		kdtree->intersect(r, sr, i, have_one);
+		typedef vector<Geometry*>::const_iterator iter;
+		for(iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j) {
+			isect cur;
+			if( (*j)->intersect(r, sr, cur) ) {
+				if(!have_one || (cur.t < i.t)) {
+					i = cur;
+					have_one = true;
+				}
+			}
+		}
 	} else {
 		typedef vector<Geometry*>::const_iterator iter;
 		for(iter j = objects.begin(); j != objects.end(); ++j) {
 			isect cur;
-			if( (*j)->intersect(r, cur) ) {
+			if( (*j)->intersect(r, sr, cur) ) {
 				if(!have_one || (cur.t < i.t)) {
 					i = cur;
 					have_one = true;
@@ -90,6 +199,58 @@ bool Scene::intersect(ray& r, isect& i) const {
 	return have_one;
 }
 
+// The packet path needs the kd-tree; without it, and while debugging
+// (which records every ray), the rays go one at a time.
+void Scene::intersect(RayPacket& pk) const {
+	pk.hit = 0;
+	for(int k = 0; k < pk.size; ++k) pk.tMax[k] = 1.0e308;
+	if(kdtree && traceUI->useKdTree() && !TraceUI::m_debug) {
+		PacketSlabs slabs(pk);
+		kdtree->intersect(pk, slabs, pk.all());
+		typedef vector<Geometry*>::const_iterator iter;
+		for(iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j)
+			(*j)->intersectPacket(pk, slabs, pk.all());
+	} else {
+		for(int k = 0; k < pk.size; ++k)
+			if(intersect(pk.rays[k], pk.hits[k])) pk.hit |= 1 << k;
+	}
+	for(int k = 0; k < pk.size; ++k)
+		if(!(pk.hit & (1 << k))) pk.hits[k].setT(1000.0);
+}
+
+void Scene::occluded(RayPacket& pk) const {
+	renderCounters.rays[ray::SHADOW] += pk.size;
+	pk.occluded = pk.translucent = 0;
+	PacketSlabs slabs(pk);
+	if(kdtree && traceUI->useKdTree()) {
+		kdtree->occluded(pk, slabs, pk.all());
+		typedef vector<Geometry*>::const_iterator iter;
+		for(iter j = nonboundedobjects.begin(); j != nonboundedobjects.end() && pk.occluded != pk.all(); ++j)
+			pk.occluded |= (*j)->occludedPacket(pk, slabs, pk.all() & ~pk.occluded);
+	} else {
+		typedef vector<Geometry*>::const_iterator iter;
+		for(iter j = objects.begin(); j != objects.end() && pk.occluded != pk.all(); ++j)
+			pk.occluded |= (*j)->occludedPacket(pk, slabs, pk.all() & ~pk.occluded);
+	}
+}
+
+bool Scene::occluded(ray& r, double tmax, bool& translucent) const {
+	++renderCounters.rays[r.type()];
+	typedef vector<Geometry*>::const_iterator iter;
+	SlabRay sr(r);
+	if(kdtree && traceUI->useKdTree()) {
+		if(kdtree->occluded(r, sr, tmax, translucent)) return true;
+		for(iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j) {
+			if((*j)->occluded(r, sr, tmax, translucent)) return true;
+		}
+	} else {
+		for(iter j = objects.begin(); j != objects.end(); ++j) {
+			if((*j)->occluded(r, sr, tmax, translucent)) return true;
+		}
+	}
+	return false;
+}
+
 TextureMap* Scene::getTexture(string name) {
 	tmap::const_iterator itr = textureCache.find(name);
 	if(itr == textureCache.end()) {
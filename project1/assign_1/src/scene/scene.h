@@ -28,9 +28,12 @@ using namespace std;
 
 class Light;
 class Scene;
+struct KdTreeStats;
 
 template <typename Obj>
 class KdTree;
+struct RayPacket;
+struct PacketSlabs;
 
 class SceneElement {
 
@@ -49,6 +52,14 @@ public:
   Scene *scene;
 };
 
+// What a TransformNode does, from the cheapest to the most general.
+enum TransformKind {
+  TRANSFORM_IDENTITY,
+  TRANSFORM_TRANSLATION,
+  TRANSFORM_UNIFORM_SCALE,   // rotation, uniform scale and translation
+  TRANSFORM_AFFINE
+};
+
 class TransformNode {
 
 protected:
@@ -58,6 +69,13 @@ protected:
   Mat4d    inverse;
   Mat3d    normi;
 
+  // The inverse again, as the affine map invLinear * v + invTranslation,
+  // and what kind of transform it is, for the fast paths of rayToLocal().
+  Mat3d    invLinear;
+  Vec3d    invTranslation;
+  TransformKind kind;
+  double   lengthScale;   // local length of a unit global vector, for UNIFORM_SCALE
+
   // information about parent & children
   TransformNode *parent;
   std::vector<TransformNode*> children;
@@ -77,14 +95,45 @@ protected:
   }
     
   // Coordinate-Space transformation
-  Vec3d globalToLocalCoords(const Vec3d &v) { return inverse * v; }
+  Vec3d globalToLocalCoords(const Vec3d &v) const { return inverse * v; }
+
+  TransformKind getKind() const { return kind; }
+
+  // r in local coordinates, its direction normalized, leaving r alone.
+  // Returns how much the transform stretched the direction: distances
+  // along local are that many times those along r.  r's direction must
+  // be normalized.
+  double rayToLocal(const ray& r, ray& local) const {
+    switch(kind) {
+    case TRANSFORM_IDENTITY:
+      local = r;
+      return 1.0;
+    case TRANSFORM_TRANSLATION:
+      local = ray(r.p + invTranslation, r.d, r.t);
+      return 1.0;
+    case TRANSFORM_UNIFORM_SCALE:
+      local = ray(invLinear * r.p + invTranslation, (invLinear * r.d) / lengthScale, r.t);
+      return lengthScale;
+    default: {
+      Vec3d dir = invLinear * r.d;
+      double length = dir.length();
+      local = ray(invLinear * r.p + invTranslation, dir / length, r.t);
+      return length;
+    }
+    }
+  }
+
+  // rayToLocal() for the rays of mask in pk, into the same places in
+  // local, with the stretches in length[]; the points and directions are
+  // transformed all at once (see vecmath/simd.h), to the same results.
+  void packetToLocal(const RayPacket& pk, int mask, RayPacket& local, double* length) const;
 
   Vec3d localToGlobalCoords(const Vec3d &v) { return xform * v; }
 
   Vec4d localToGlobalCoords(const Vec4d &v) { return xform * v; }
 
-  Vec3d localToGlobalCoordsNormal(const Vec3d &v) {
-    Vec3d ret = normi * v;
+  Vec3d localToGlobalCoordsNormal(const Vec3d &v) const {
+    Vec3d ret = kind <= TRANSFORM_TRANSLATION ? v : normi * v;
     ret.normalize();
     return ret;
   }
@@ -101,7 +150,29 @@ protected:
       else this->xform = parent->xform * xform;  
       inverse = this->xform.inverse();
       normi = this->xform.upper33().inverse().transpose();
+      classify();
+    }
+
+private:
+  void classify() {
+    invLinear = inverse.upper33();
+    invTranslation = Vec3d(inverse[0][3], inverse[1][3], inverse[2][3]);
+    lengthScale = 1.0;
+    Mat3d linear = xform.upper33();
+    if(linear == Mat3d()) {
+      kind = invTranslation.iszero() ? TRANSFORM_IDENTITY : TRANSFORM_TRANSLATION;
+      return;
     }
+    // rotation times a uniform scale s: the columns are orthogonal and
+    // all of length s, so linear^T linear is s^2 times the identity
+    Mat3d gram = linear.transpose() * linear;
+    double s2 = gram[0][0];
+    kind = TRANSFORM_UNIFORM_SCALE;
+    for(int a = 0; a < 3; ++a)
+      for(int b = 0; b < 3; ++b)
+        if(fabs(gram[a][b] - (a == b ? s2 : 0.0)) > 1.0e-12 * s2) kind = TRANSFORM_AFFINE;
+    if(kind == TRANSFORM_UNIFORM_SCALE) lengthScale = 1.0 / sqrt(s2);
+  }
 };
 
 class TransformRoot : public TransformNode {
@@ -119,15 +190,37 @@ protected:
   // do not call directly - this should only be called by intersect()
   virtual bool intersectLocal(ray& r, isect& i ) const = 0;
 
+  // any-hit version of intersectLocal, for shadow rays: true if an opaque
+  // part of the object lies along r before local distance tmax.  Hits on
+  // transmissive material don't occlude but set translucent.  The default
+  // is built on intersectLocal.
+  virtual bool occludedLocal(ray& r, double tmax, bool& translucent) const;
+
+  // intersect() and occluded() once r is known to meet the bounding box.
+  bool intersectInBox(ray& r, isect& i) const;
+  bool occludedInBox(ray& r, double tmax, bool& translucent) const;
+
 public:
-  // intersections performed in the global coordinate space.
-  bool intersect(ray& r, isect& i) const;
+  // intersections performed in the global coordinate space.  sr is r
+  // set up for the bounding box test, once for all the objects r meets.
+  bool intersect(ray& r, const SlabRay& sr, isect& i) const;
+  bool occluded(ray& r, const SlabRay& sr, double tmax, bool& translucent) const;
+
+  // Packet versions for the rays of mask, with slabs set up from pk:
+  // intersectPacket() replaces pk.hits[k] when ray k hits closer than
+  // pk.tMax[k], and returns those rays; occludedPacket() returns the
+  // rays it blocks before pk.tMax[k] and adds those that pass through
+  // transmissive parts to pk.translucent.  The defaults test the
+  // bounding box against the whole packet, then go ray by ray.
+  virtual int intersectPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
+  virtual int occludedPacket(RayPacket& pk, const PacketSlabs& slabs, int mask) const;
 
   virtual bool hasBoundingBoxCapability() const;
   virtual bool isTrimesh() const { return false; };
   const BoundingBox& getBoundingBox() const { return bounds; }
   Vec3d getNormal() { return Vec3d(1.0, 0.0, 0.0); }
-  virtual void buildKdTree() {}
+  virtual void buildKdTree(KdSplitMethod) {}
+  virtual void collectKdTreeStats(KdTreeStats&) const {}
   virtual void ComputeBoundingBox() {
     // take the object's local bounding box, transform all 8 points on it,
     // and use those to find a new bounding box.
@@ -173,6 +266,7 @@ public:
   virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
   void setTransform(TransformNode *transform) { this->transform = transform; };
+  const TransformNode* getTransform() const { return transform; }
     
  Geometry(Scene *scene) : SceneElement( scene ) {}
 
@@ -197,6 +291,12 @@ class SceneObject : public Geometry {
  public:
   virtual const Material& getMaterial() const = 0;
   virtual void setMaterial(Material *m) = 0;
+  // The material at a hit: getMaterial(), unless the object's material
+  // varies over it, in which case it is worked out into scratch.
+  virtual const Material& materialAt(const isect&, MaterialScratch&) const { return getMaterial(); }
+  // Whether the material at a hit is transmissive, as materialAt() would
+  // have it, but without building it.
+  virtual bool isTranslucentAt(const isect&) const { return getMaterial().Trans(); }
 
   void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
@@ -232,7 +332,7 @@ public:
 
   TransformRoot transformRoot;
 
-  Scene() : transformRoot(), objects(), lights(), kdtree(NULL) {}
+  Scene() : transformRoot(), objects(), lights(), kdtree(NULL), kdSplit(KD_SPLIT_SAH) {}
   virtual ~Scene();
 
   void add( Geometry* obj ) {
@@ -243,6 +343,16 @@ public:
   void add(Light* light) { lights.push_back(light); }
 
   bool intersect(ray& r, isect& i) const;
+  // The closest hits for all the rays of a packet, in pk.hits and pk.hit.
+  void intersect(RayPacket& pk) const;
+
+  // Shadow ray query: stops at the first opaque object closer than tmax.
+  // If it returns false but translucent is set, the ray passed through
+  // transmissive material and the caller needs intersect() to find it.
+  bool occluded(ray& r, double tmax, bool& translucent) const;
+  // The same for a packet of shadow rays, each with its tmax in pk.tMax;
+  // sets pk.occluded and pk.translucent.
+  void occluded(RayPacket& pk) const;
 
   std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
   std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -268,7 +378,11 @@ public:
 
   const BoundingBox& bounds() const { return sceneBounds; }
 
+  // Builds the scene tree and the per-Trimesh trees with the split method
+  // selected in the UI; kdTreeSplit() is the method the current trees used.
   void buildKdTree();
+  KdSplitMethod kdTreeSplit() const { return kdSplit; }
+  void collectKdTreeStats(KdTreeStats& sceneTree, KdTreeStats& meshTrees) const;
 
  private:
   std::vector<Geometry*> objects;
@@ -290,71 +404,13 @@ public:
   BoundingBox sceneBounds;
   
   KdTree<Geometry>* kdtree;
+  KdSplitMethod kdSplit;
 
  public:
   // This is used for debugging purposes only.
   mutable std::vector<std::pair<ray*, isect*> > intersectCache;
 };
 
-template<class T>
-class KdTree {
-public:
-  KdTree<T>* left;
-  KdTree<T>* right;
-  BoundingBox bb;
-  vector<T*> obj;
-  int depth;
-
-  KdTree(vector<T*>& o, int d) : depth(d), left(NULL), right(NULL), bb() {
-    if(o.size() == 0) {
-      obj = vector<T*>();
-      return;
-    }
-    bb = o[0]->getBoundingBox();
-    for(int i = 1; i < o.size(); ++i) {
-      bb.merge(o[i]->getBoundingBox());
-    }
-    if(o.size() <= 15 || depth >= 10) {
-      obj = o;
-      return;
-    }
-
-    vector<T*> leftObj, rightObj;
-    int maxAxis = bb.getMaxAxis();
-    double maxCenter = bb.getCenter()[maxAxis];
-    for(int i = 0; i < o.size(); ++i) {
-      if(o[i]->getBoundingBox().getCenter()[maxAxis] < maxCenter) leftObj.push_back(o[i]);
-      else rightObj.push_back(o[i]);
-    }
-
-    if(leftObj.empty() && !rightObj.empty()) leftObj = rightObj;
-    if(!leftObj.empty() && rightObj.empty()) rightObj = leftObj;
-
-    left = new KdTree<T>(leftObj, depth + 1);
-    right = new KdTree<T>(rightObj, depth + 1);
-
-  }
-
-  void intersect(ray& r, isect& i, bool& have_one) {
-    double tmin, tmax;
-    if(bb.intersect(r, tmin, tmax)) {
-      if(left && right) {
-        left->intersect(r, i, have_one);
-        //if(have_one) return;
-        right->intersect(r, i, have_one);
-      } else {
-        isect cur;
-        for(int j = 0; j < obj.size(); ++j) {
-          if(obj[j]->intersect(r, cur)) {
-            if(!have_one || (cur.t < i.t)) {
-              i = cur;
-              have_one = true;
-            }
-          }
-        }
-      }  
-    }
-  }
-};
+#include "kdtree.h"
 
 #endif // __SCENE_H__
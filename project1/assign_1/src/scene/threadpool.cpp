@@ -0,0 +1,111 @@
+#include "threadpool.h"
+
+// The pool and queue index of the current thread when it is a worker.
+static thread_local ThreadPool* currentPool = NULL;
+static thread_local int currentQueue = -1;
+
+ThreadPool::ThreadPool(int threads) : queued(0), stopping(false) {
+  if(threads <= 0) threads = std::thread::hardware_concurrency();
+  if(threads <= 0) threads = 1;
+  for(int i = 0; i <= threads; ++i) queues.push_back(new Queue);
+  for(int i = 0; i < threads; ++i) {
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lk(sleepLock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for(size_t i = 0; i < workers.size(); ++i) workers[i].join();
+  for(size_t i = 0; i < queues.size(); ++i) delete queues[i];
+}
+
+ThreadPool& ThreadPool::shared() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::submit(const std::function<void()>& f) {
+  int q = currentPool == this ? currentQueue : workers.size();
+  {
+    std::lock_guard<std::mutex> lk(queues[q]->lock);
+    queues[q]->tasks.push_back(f);
+  }
+  {
+    // under sleepLock so a worker can't check 'queued' and then miss this
+    std::lock_guard<std::mutex> lk(sleepLock);
+    ++queued;
+  }
+  wake.notify_one();
+  finished.notify_all();
+}
+
+void ThreadPool::notifyWaiters() {
+  {
+    // as in submit(), so a waiter can't check and then miss this
+    std::lock_guard<std::mutex> lk(sleepLock);
+  }
+  finished.notify_all();
+}
+
+bool ThreadPool::runPending() {
+  int self = currentPool == this ? currentQueue : workers.size();
+  std::function<void()> task;
+
+  Queue* own = queues[self];
+  {
+    std::lock_guard<std::mutex> lk(own->lock);
+    if(!own->tasks.empty()) {
+      task = own->tasks.back();
+      own->tasks.pop_back();
+    }
+  }
+
+  // steal the oldest (and so usually largest) task of another queue
+  for(size_t i = 1; !task && i < queues.size(); ++i) {
+    Queue* victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> lk(victim->lock);
+    if(!victim->tasks.empty()) {
+      task = victim->tasks.front();
+      victim->tasks.pop_front();
+    }
+  }
+
+  if(!task) return false;
+  --queued;
+  task();
+  return true;
+}
+
+void ThreadPool::workerLoop(int index) {
+  currentPool = this;
+  currentQueue = index;
+  for(;;) {
+    if(runPending()) continue;
+    std::unique_lock<std::mutex> lk(sleepLock);
+    wake.wait(lk, [this] { return stopping || queued > 0; });
+    if(stopping) return;
+  }
+}
+
+void TaskGroup::run(const std::function<void()>& f) {
+  ++pending;
+  // the group may be gone once pending reaches 0, the pool is not
+  ThreadPool* p = &pool;
+  pool.submit([this, p, f] {
+    f();
+    if(--pending == 0) p->notifyWaiters();
+  });
+}
+
+void TaskGroup::wait() {
+  while(pending > 0) {
+    if(pool.runPending()) continue;
+    // nothing to help with: sleep until a task is queued or ours finish
+    std::unique_lock<std::mutex> lk(pool.sleepLock);
+    pool.finished.wait(lk, [this] { return pending == 0 || pool.queued > 0; });
+  }
+}
@@ -0,0 +1,85 @@
+//
+// threadpool.h
+//
+// A small work-stealing thread pool.  Each worker owns a deque of tasks:
+// it pushes and pops its own work at the back (so recursive work stays
+// depth-first and cache-warm) and steals from the front of the others'
+// deques when it runs dry.  Threads that are not workers submit into a
+// shared queue.
+//
+// Tasks are grouped with a TaskGroup, whose wait() runs pending tasks
+// while there are any and only sleeps when there are none, so a task may
+// safely fork and wait on subtasks.
+//
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+  // threads <= 0 means one per hardware thread.
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
+
+  int size() const { return workers.size(); }
+
+  // Process-wide pool, created on first use.
+  static ThreadPool& shared();
+
+private:
+  friend class TaskGroup;
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  void submit(const std::function<void()>& f);
+  // Wakes the threads sleeping in TaskGroup::wait().
+  void notifyWaiters();
+  // Runs one pending task, preferring the caller's own queue.  Returns
+  // false if there was nothing to run.
+  bool runPending();
+  void workerLoop(int index);
+
+  std::vector<std::thread> workers;
+  std::vector<Queue*> queues;    // one per worker, then the shared queue
+  std::atomic<int> queued;
+  std::mutex sleepLock;
+  std::condition_variable wake;      // workers: a task was queued
+  std::condition_variable finished;  // waiters: a group may be done
+  bool stopping;
+
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator =(const ThreadPool&);
+};
+
+// A set of tasks that can be waited on together.
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool& p = ThreadPool::shared()) : pool(p), pending(0) {}
+  ~TaskGroup() { wait(); }
+
+  void run(const std::function<void()>& f);
+  // Returns once every task run() on this group has finished, executing
+  // pending tasks (of any group) in the meantime and sleeping while the
+  // rest of its tasks run on other threads.
+  void wait();
+
+private:
+  ThreadPool& pool;
+  std::atomic<int> pending;
+
+  TaskGroup(const TaskGroup&);
+  TaskGroup& operator =(const TaskGroup&);
+};
+
+#endif // __THREADPOOL_H__
@@ -1,17 +1,29 @@
 #include <iostream>
+#include <fstream>
 #include <time.h>
 #include <stdarg.h>
 #include <thread>
 #include <vector>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <chrono>
+#include <sys/resource.h>
 
 #include "CommandLineUI.h"
 #include "../fileio/bitmap.h"
+#include "../fileio/pfm.h"
 
 #include "../RayTracer.h"
+#include "../RenderJob.h"
+#include "../scene/scene.h"
 
 using namespace std;
 
+// Samples per pixel at which a time-budgeted render stops early.
+static const int MAX_BUDGET_SAMPLES = 1 << 16;
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI( int argc, char* const* argv )
@@ -20,8 +32,34 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	int i;
 
 	progName=argv[0];
+	statsName=NULL;
+	cubeMapDir=NULL;
+	floatName=NULL;
+	timeBudget=0;
 
-	while( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	// getopt only knows single letter options, so the long ones are taken
+	// out first.
+	std::vector<char*> args;
+	for( int k = 0; k < argc; k++ )
+	{
+		const char* arg = argv[k];
+		bool ok = true;
+		if( !strcmp( arg, "--time-budget" ) )
+			ok = k + 1 < argc && parseTimeBudget( argv[++k] );
+		else if( !strncmp( arg, "--time-budget=", 14 ) )
+			ok = parseTimeBudget( arg + 14 );
+		else
+			args.push_back( argv[k] );
+		if( !ok ) {
+			std::cerr << "Invalid time budget." << std::endl;
+			usage();
+			exit(1);
+		}
+	}
+	argc = args.size();
+	argv = &args[0];
+
+	while( (i = getopt( argc, argv, "tpWr:w:h:k:j:b:s:c:a:e:m:x:f:q:" )) != EOF )
 	{
 		switch( i )
 		{
@@ -32,6 +70,91 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+
+			case 'k':
+				if( !strcmp( optarg, "sah" ) ) m_kdSplit = KD_SPLIT_SAH;
+				else if( !strcmp( optarg, "mid" ) ) m_kdSplit = KD_SPLIT_MIDPOINT;
+				else if( !strcmp( optarg, "none" ) ) m_useKdTree = false;
+				else {
+					std::cerr << "Invalid kd-tree method: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'j':
+				m_threadNum = atoi( optarg );
+				if( m_threadNum < 1 ) {
+					std::cerr << "Invalid thread count: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'b':
+				m_tileSize = atoi( optarg );
+				if( m_tileSize < 1 ) {
+					std::cerr << "Invalid tile size: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 's':
+				statsName = optarg;
+				break;
+
+			case 'c':
+				cubeMapDir = optarg;
+				break;
+
+			case 'p':
+				m_progressive = true;
+				break;
+
+			case 'W':
+				m_wavefront = true;
+				break;
+
+			case 'x':
+				m_exposure = atof( optarg );
+				break;
+
+			case 'f':
+				floatName = optarg;
+				break;
+
+			case 'q':
+				m_packetSize = atoi( optarg );
+				if( m_packetSize < 1 || m_packetSize > 4 ) {
+					std::cerr << "Invalid packet size: '" << optarg << "' (1 to 4)." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'a':
+				m_aaSize = atoi( optarg );
+				if( m_aaSize < 1 ) {
+					std::cerr << "Invalid anti-aliasing size: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'e':
+				m_adaptiveAA = true;
+				m_aaThreshold = atof( optarg );
+				break;
+
+			case 'm':
+				m_aaMaxSamples = atoi( optarg );
+				if( m_aaMaxSamples < 4 ) {
+					std::cerr << "Invalid sample budget: '" << optarg << "' (at least 4)." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
 			default:
 			// Oops; unknown argument
 			std::cerr << "Invalid argument: '" << i << "'." << std::endl;
@@ -40,6 +163,13 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 		}
 	}
 
+	if( m_adaptiveAA && m_aaSize < 2 )
+	{
+		std::cerr << "-e refines within the -a grid; give -a 2 or more." << std::endl;
+		usage();
+		exit(1);
+	}
+
 	if( optind >= argc-1 )
 	{
 		std::cerr << "no input and/or output name." << std::endl;
@@ -49,17 +179,34 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	rayName = argv[optind];
 	imgName = argv[optind+1];
 }
-void thread_trace(int xStart, int xEnd, int yStart, int yEnd, RayTracer* raytracer) {
-		for(int j = yStart; j < yEnd; ++j) {
-			for(int i = xStart; i < xEnd; ++i) {
-				raytracer->tracePixel(i, j);
-			}
-		}
+// Percentage done on stderr, for interactive runs.
+static void printProgress(int done, int total) {
+		static std::mutex lock;
+		static int lastPercent = -1;
+		std::lock_guard<std::mutex> lk(lock);
+		int percent = 100 * done / total;
+		if (percent == lastPercent) return;
+		lastPercent = percent;
+		std::cerr << "\rrendering " << percent << "%" << std::flush;
+}
+
+// Seconds, as a positive decimal number.
+bool CommandLineUI::parseTimeBudget( const char* arg )
+{
+	char* end;
+	timeBudget = strtod( arg, &end );
+	return end != arg && *end == '\0' && timeBudget > 0;
 }
 
 int CommandLineUI::run()
 {
 	assert( raytracer != 0 );
+	// A time budget is for the whole run, scene loading included.
+	std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+
+	size_t len = strlen( rayName );
+	if( len > 4 && !strcmp( rayName + len - 4, ".pfm" ) )
+		return reexpose();
 	raytracer->loadScene( rayName );
 
 	if( raytracer->sceneLoaded() )
@@ -69,27 +216,47 @@ int CommandLineUI::run()
 
 		raytracer->traceSetup( width, height );
 
-		int numThread = thread::hardware_concurrency();
-        int heightOffset = int (height / numThread);
-        vector<thread> threads;
-		clock_t start, end;
-		start = clock();
+		if( cubeMapDir && !loadCubeMap( cubeMapDir ) )
+			return 1;
 
-		for(int i = 0; i < numThread - 1; ++i) {
-				threads.push_back(thread(thread_trace, 0, width, i * heightOffset, (i + 1) * heightOffset, raytracer));
+		if( m_useKdTree )
+		{
+			KdTreeStats sceneTree, meshTrees;
+			raytracer->getScene().collectKdTreeStats( sceneTree, meshTrees );
+			std::cout << "kd-tree (" << (m_kdSplit == KD_SPLIT_SAH ? "sah" : "mid") << ")" << std::endl;
+			std::cout << "  scene:  " << sceneTree << std::endl;
+			std::cout << "  meshes: " << meshTrees << std::endl;
+			int mesh = 0;
+			const Scene& scene = raytracer->getScene();
+			for( Scene::cgiter g = scene.beginObjects(); g != scene.endObjects(); ++g )
+			{
+				if( !(*g)->isTrimesh() ) continue;
+				KdTreeStats s;
+				(*g)->collectKdTreeStats( s );
+				std::cout << "    mesh " << mesh++ << ": " << s.objects << " faces, built in "
+				          << s.buildSeconds << " s" << std::endl;
 			}
-		for (int y = (numThread - 1) * heightOffset; y < height; y++)
-		  {
-		    for (int x = 0; x < width; x++)
-		      {
-			    raytracer->tracePixel(x, y);
-		      }
-		  }
-        for(int i = 0; i < threads.size(); ++i) {
-        	threads[i].join();
-        }
-
-		end=clock();
+		}
+
+		bool interactive = isatty(2) && !timeBudget;
+		RenderJob job(raytracer, width, height, m_threadNum, m_tileSize);
+		if (interactive) job.setProgressCallback(printProgress);
+		if (timeBudget) job.setProgressive(MAX_BUDGET_SAMPLES);
+		else if (m_progressive) job.setProgressive(m_aaSize * m_aaSize);
+		job.setPacketSize(m_packetSize);
+		job.setWavefront(m_wavefront);
+		job.start();
+		if (timeBudget)
+		{
+			// Refine until the deadline, then keep what the last
+			// samples made of the image.
+			double left = timeBudget - std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - runStart ).count();
+			if( !job.wait( std::max( int( left * 1000 ), 0 ) ) )
+				job.cancel();
+		}
+		job.wait();
+		if (interactive) std::cerr << std::endl;
 
 		// save image
 		unsigned char* buf;
@@ -99,9 +266,43 @@ int CommandLineUI::run()
 		if (buf)
 			writeBMP(imgName, width, height, buf);
 
-		double t=(double)(end-start)/CLOCKS_PER_SEC;
-//		int totalRays = TraceUI::resetCount();
-//		std::cout << "total time = " << t << " seconds, rays traced = " << totalRays << std::endl;
+		if( floatName )
+		{
+			std::vector<float> linear;
+			raytracer->getLinearImage( linear );
+			if( !writePFM( floatName, width, height, &linear[0] ) )
+			{
+				std::cerr << "Unable to write float image '" << floatName << "'" << std::endl;
+				return 1;
+			}
+		}
+
+		double t = job.seconds();
+		const RenderCounters& c = job.counters();
+		std::cout << "total time = " << t << " seconds (wall), " << m_threadNum << " threads, rays traced = "
+		          << c.totalRays() << " (primary " << c.rays[ray::VISIBILITY]
+		          << ", reflection " << c.rays[ray::REFLECTION]
+		          << ", refraction " << c.rays[ray::REFRACTION]
+		          << ", shadow " << c.rays[ray::SHADOW] << "), "
+		          << c.totalRays() / t * 1.0e-6 << " Mrays/s" << std::endl;
+		std::cout << "  kd-tree node visits = " << c.nodeVisits
+		          << ", triangle tests = " << c.triangleTests << std::endl;
+		std::cout << "  samples per pixel = " << double( c.rays[ray::VISIBILITY] ) / ( width * height )
+		          << ", peak memory = " << peakMemoryKB() << " KB" << std::endl;
+		if( timeBudget )
+		{
+			std::cout << "  time budget = " << timeBudget << " seconds, " << job.samplesDone()
+			          << " full passes of samples" << std::endl;
+			if( job.passesDone() == 0 )
+				std::cerr << "Time budget ran out before the first preview pass; "
+				          << "parts of the image are black." << std::endl;
+		}
+
+		if( statsName && !writeStats( statsName, width, height, t, c, job.samplesDone() ) )
+		{
+			std::cerr << "Unable to write stats file '" << statsName << "'" << std::endl;
+			return 1;
+		}
         return 0;
 	}
 	else
@@ -111,6 +312,115 @@ int CommandLineUI::run()
 	}
 }
 
+// Tone maps a linear image saved with -f, at the -x exposure, instead of
+// rendering a scene.
+int CommandLineUI::reexpose()
+{
+	int width, height;
+	float* linear = readPFM( rayName, width, height );
+	if( !linear )
+	{
+		std::cerr << "Unable to read float image '" << rayName << "'" << std::endl;
+		return 1;
+	}
+
+	raytracer->setExposure( m_exposure );
+	raytracer->setLinearImage( linear, width, height );
+	delete [] linear;
+
+	unsigned char* buf;
+	raytracer->getBuffer( buf, width, height );
+	writeBMP( imgName, width, height, buf );
+	return 0;
+}
+
+// Loads the six faces of a cube map from dir, named as the cube map
+// chooser labels them: xpos, xneg, ypos, yneg, zpos and zneg, each .bmp
+// or .png.
+bool CommandLineUI::loadCubeMap( const char* dir )
+{
+	static const char* faces[6] = { "xpos", "xneg", "ypos", "yneg", "zpos", "zneg" };
+	TextureMap* maps[6] = { 0, 0, 0, 0, 0, 0 };
+
+	for( int i = 0; i < 6; i++ )
+	{
+		string base = string( dir ) + "/" + faces[i];
+		string name = base + ".bmp";
+		if( access( name.c_str(), R_OK ) != 0 ) name = base + ".png";
+		try { maps[i] = new TextureMap( name ); }
+		catch( TextureMapException& xcpt )
+		{
+			std::cerr << xcpt.message() << std::endl;
+			for( int j = 0; j < i; j++ ) delete maps[j];
+			return false;
+		}
+	}
+
+	CubeMap* cm = new CubeMap();
+	cm->setXposMap( maps[0] );
+	cm->setXnegMap( maps[1] );
+	cm->setYposMap( maps[2] );
+	cm->setYnegMap( maps[3] );
+	cm->setZposMap( maps[4] );
+	cm->setZnegMap( maps[5] );
+	raytracer->setCubeMap( cm );
+	setCubeMap( true );
+	useCubeMap( true );
+	return true;
+}
+
+// The high water mark of the resident set, in kilobytes.
+long CommandLineUI::peakMemoryKB()
+{
+	struct rusage usage;
+	if( getrusage( RUSAGE_SELF, &usage ) != 0 ) return 0;
+	return usage.ru_maxrss;
+}
+
+// The render statistics as JSON, for tracking performance across builds.
+bool CommandLineUI::writeStats( const char* fileName, int width, int height,
+                                double seconds, const RenderCounters& c, int fullPasses )
+{
+	std::ofstream out( fileName );
+	if( !out ) return false;
+
+	string scene;
+	for( const char* p = rayName; *p; ++p )
+	{
+		if( *p == '"' || *p == '\\' ) scene += '\\';
+		scene += *p;
+	}
+
+	out << "{" << std::endl;
+	out << "  \"scene\": \"" << scene << "\"," << std::endl;
+	out << "  \"width\": " << width << "," << std::endl;
+	out << "  \"height\": " << height << "," << std::endl;
+	out << "  \"depth\": " << m_nDepth << "," << std::endl;
+	out << "  \"threads\": " << m_threadNum << "," << std::endl;
+	out << "  \"tile_size\": " << m_tileSize << "," << std::endl;
+	out << "  \"kdtree\": \"" << ( !m_useKdTree ? "none" : m_kdSplit == KD_SPLIT_SAH ? "sah" : "mid" ) << "\"," << std::endl;
+	out << "  \"seconds\": " << seconds << "," << std::endl;
+	out << "  \"rays\": {" << std::endl;
+	out << "    \"primary\": " << c.rays[ray::VISIBILITY] << "," << std::endl;
+	out << "    \"reflection\": " << c.rays[ray::REFLECTION] << "," << std::endl;
+	out << "    \"refraction\": " << c.rays[ray::REFRACTION] << "," << std::endl;
+	out << "    \"shadow\": " << c.rays[ray::SHADOW] << "," << std::endl;
+	out << "    \"total\": " << c.totalRays() << std::endl;
+	out << "  }," << std::endl;
+	out << "  \"samples_per_pixel\": " << double( c.rays[ray::VISIBILITY] ) / ( width * height ) << "," << std::endl;
+	out << "  \"mrays_per_second\": " << c.totalRays() / seconds * 1.0e-6 << "," << std::endl;
+	out << "  \"node_visits\": " << c.nodeVisits << "," << std::endl;
+	out << "  \"triangle_tests\": " << c.triangleTests << "," << std::endl;
+	if( timeBudget )
+	{
+		out << "  \"time_budget\": " << timeBudget << "," << std::endl;
+		out << "  \"full_sample_passes\": " << fullPasses << "," << std::endl;
+	}
+	out << "  \"peak_rss_kb\": " << peakMemoryKB() << std::endl;
+	out << "}" << std::endl;
+	return bool( out );
+}
+
 void CommandLineUI::alert( const string& msg )
 {
 	std::cerr << msg << std::endl;
@@ -121,4 +431,26 @@ void CommandLineUI::usage()
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
+	std::cerr << "  -k <method> kd-tree split: sah, mid or none (default sah)" << std::endl;
+	std::cerr << "  -j <#>      number of render threads (default " << m_threadNum << ")" << std::endl;
+	std::cerr << "  -b <#>      render tile size in pixels (default " << m_tileSize << ")" << std::endl;
+	std::cerr << "  -s <file>   write render statistics to file as JSON" << std::endl;
+	std::cerr << "  -c <dir>    cube map from dir/{x,y,z}{pos,neg}.bmp or .png" << std::endl;
+	std::cerr << "  -a <#>      anti-alias on an #x# grid of samples per pixel (default " << m_aaSize << ")" << std::endl;
+	std::cerr << "  -e <#>      adaptive anti-aliasing: refine down to the -a grid only where" << std::endl;
+	std::cerr << "              samples differ by more than # (e.g. " << m_aaThreshold << ")" << std::endl;
+	std::cerr << "  -m <#>      with -e, trace at most # samples per pixel on average over" << std::endl;
+	std::cerr << "              the render, at least 4 (default " << m_aaMaxSamples << ")" << std::endl;
+	std::cerr << "  -p          render progressively, one sample per pixel per pass up to" << std::endl;
+	std::cerr << "              the -a grid (adaptive anti-aliasing does not apply)" << std::endl;
+	std::cerr << "  -q <#>      trace camera and shadow rays in packets of #x#, 1 to 4 (default" << std::endl;
+	std::cerr << "              " << m_packetSize << ", one at a time); not with -p or -e" << std::endl;
+	std::cerr << "  -W          trace each tile breadth first, a generation of rays at a" << std::endl;
+	std::cerr << "              time; same image, not with -p" << std::endl;
+	std::cerr << "  -x <#>      exposure in stops, applied before colours are clamped (default 0)" << std::endl;
+	std::cerr << "  -f <file>   also write the linear, unclamped image as a PFM file; given" << std::endl;
+	std::cerr << "              one as input.ray, the renderer just tone maps it again" << std::endl;
+	std::cerr << "  --time-budget <s>" << std::endl;
+	std::cerr << "              render progressively for s seconds in all, scene loading" << std::endl;
+	std::cerr << "              included, and write what there is by then" << std::endl;
 }
@@ -9,6 +9,8 @@
 
 #include "TraceUI.h"
 
+struct RenderCounters;
+
 // ***********************************************************
 // from getopt.cpp
 //#ifdef _WIN32
@@ -30,10 +32,20 @@ public:
 
 private:
 	void		usage();
+	bool		writeStats( const char* fileName, int width, int height,
+				    double seconds, const RenderCounters& c, int fullPasses );
+	bool		loadCubeMap( const char* dir );
+	long		peakMemoryKB();
+	bool		parseTimeBudget( const char* arg );
+	int		reexpose();
 
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+	char*	statsName;
+	char*	cubeMapDir;
+	char*	floatName;	// PFM copy of the linear framebuffer
+	double	timeBudget;	// seconds, or 0 for none
 };
 
 #endif
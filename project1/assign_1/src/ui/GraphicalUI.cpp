@@ -16,6 +16,7 @@
 
 #include "GraphicalUI.h"
 #include "../RayTracer.h"
+#include "../RenderJob.h"
 
 #define MAX_INTERVAL 500
 
@@ -74,7 +75,7 @@ void GraphicalUI::cb_save_image(Fl_Menu_* o, void* v)
 {
 	pUI = whoami(o);
 
-	char* savefile = fl_file_chooser("Save Image?", "*.bmp", "save.bmp" );
+	char* savefile = fl_file_chooser("Save Image?", "*.{bmp,pfm}", "save.bmp" );
 	if (savefile != NULL) {
 		pUI->m_traceGlWindow->saveImage(savefile);
 	}
@@ -129,11 +130,35 @@ void GraphicalUI::cb_aaSlides(Fl_Widget* o, void* v)
 	((GraphicalUI*)(o->user_data()))->m_aaSize=int( ((Fl_Slider *)o)->value() ) ;
 }
 
+void GraphicalUI::cb_aaThreshSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_aaThreshold=double( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_aaMaxSamplesSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_aaMaxSamples=int( ((Fl_Slider *)o)->value() ) ;
+}
+
 void GraphicalUI::cb_threadSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->m_threadNum=int( ((Fl_Slider *)o)->value() ) ;
 }
 
+// Tone maps what has been rendered again, without tracing anything.
+// During a render the worker threads own the framebuffer, so only pixels
+// finished from now on see the new exposure, and cb_render redoes the
+// rest once they are done.
+void GraphicalUI::cb_exposureSlides(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_exposure=double( ((Fl_Slider *)o)->value() ) ;
+	pUI->raytracer->setExposure(pUI->m_exposure);
+	if (!doneTrace) return;
+	pUI->raytracer->toneMapBuffer();
+	pUI->m_traceGlWindow->refresh();
+}
+
 void GraphicalUI::cb_depthSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->m_nDepth=int( ((Fl_Slider *)o)->value() ) ;
@@ -165,27 +190,57 @@ void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 	  }
 }
 
+void GraphicalUI::cb_aaCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_adaptiveAA = (((Fl_Check_Button*)o)->value() == 1);
+	if (pUI->m_adaptiveAA) {
+		pUI->m_aaThreshSlider->activate();
+		pUI->m_aaMaxSamplesSlider->activate();
+	} else {
+		pUI->m_aaThreshSlider->deactivate();
+		pUI->m_aaMaxSamplesSlider->deactivate();
+	}
+}
+
+void GraphicalUI::cb_progressiveCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_progressive = (((Fl_Check_Button*)o)->value() == 1);
+}
+
+void GraphicalUI::cb_packetCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_packetSize = (((Fl_Check_Button*)o)->value() == 1) ? 4 : 1;
+}
+
+void GraphicalUI::cb_wavefrontCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_wavefront = (((Fl_Check_Button*)o)->value() == 1);
+}
+
 void GraphicalUI::cb_cubeMapCheckButton(Fl_Widget* o, void* v)
 {
 	pUI=(GraphicalUI*)(o->user_data());
 	pUI->m_usingCubeMap = (((Fl_Check_Button*)o)->value() == 1);
 }
-/*
+
 void GraphicalUI::cb_kdCheckButton(Fl_Widget* o, void* v)
 {
 	pUI=(GraphicalUI*)(o->user_data());
 	pUI->m_useKdTree = (((Fl_Check_Button*)o)->value() == 1);
-}*/
-
+}
 
-void GraphicalUI::thread_trace(int xStart, int xEnd, int yStart, int yEnd, GraphicalUI* pUI) {
-		for(int j = yStart; j < yEnd; ++j) {
-			for(int i = xStart; i < xEnd; ++i) {
-				pUI->raytracer->tracePixel(i, j);
-			}
-		}
+void GraphicalUI::cb_sahCheckButton(Fl_Widget* o, void* v)
+{
+	pUI=(GraphicalUI*)(o->user_data());
+	// takes effect at the next render, which rebuilds the trees
+	pUI->m_kdSplit = (((Fl_Check_Button*)o)->value() == 1) ? KD_SPLIT_SAH : KD_SPLIT_MIDPOINT;
 }
 
+
 void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 
 	char buffer[256];
@@ -200,80 +255,43 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		pUI->m_traceGlWindow->resizeWindow(width, height);
 		pUI->m_traceGlWindow->show();
 		pUI->raytracer->traceSetup(width, height);
-		//thread::XInitThreads();
 		// Save the window label
         const char *old_label = pUI->m_traceGlWindow->label();
-        int numThread = pUI->m_threadNum;
-        int heightOffset = int (height / numThread);
-
-        vector<thread> threads;
-
-        //clock_t now2, prev2;
-        clock_t now, prev;
-		//prev2 = clock();
-		//cout<<"wh"<< width << " " << height <<endl;
-		//cout<<numThread<<endl;
-		if(numThread > 1) {
-			for(int i = 0; i < numThread - 1; ++i) {
-				threads.push_back(thread(thread_trace, 0, width, i * heightOffset, (i + 1) * heightOffset, pUI));
-			}
-			//threads.push_back(thread(thread_trace, 0, width, (numThread - 1) * heightOffset, height, pUI));
-			now = prev = clock();
-			clock_t intervalMS = pUI->refreshInterval * 100;
-			for (int y = (numThread - 1) * heightOffset; y < height; y++)
-			  {
-			    for (int x = 0; x < width; x++)
-			      {
-					// check for input and refresh view every so often while tracing
-					now = clock();
-					if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
-					  {
-					    prev = now;
-					    //sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-					    //pUI->m_traceGlWindow->label(buffer);
-					    pUI->m_traceGlWindow->refresh();
-					    Fl::check();
-					    if (Fl::damage()) { Fl::flush(); }
-				      }
-					// look for input and refresh window
-				    pUI->raytracer->tracePixel(x, y);
-					pUI->m_debuggingWindow->m_debuggingView->setDirty();
-			      }
-			  }
-	        for(int i = 0; i < threads.size(); ++i) {
-	        	threads[i].join();
-	        }
-		} else {
-			
-			now = prev = clock();
-			clock_t intervalMS = pUI->refreshInterval * 100;
-			for (int y = 0; y < height; y++)
+
+		// The render runs on its own threads; this one keeps the window
+		// alive, shows progress and passes on the stop button.
+		RenderJob job(pUI->raytracer, width, height, pUI->m_threadNum, pUI->m_tileSize);
+		if (pUI->m_progressive) job.setProgressive(pUI->m_aaSize * pUI->m_aaSize);
+		job.setPacketSize(pUI->m_packetSize);
+		job.setWavefront(pUI->m_wavefront);
+		job.start();
+		double exposure = pUI->m_exposure;
+		clock_t intervalMS = pUI->refreshInterval * 100;
+		clock_t sinceRefresh = 0;
+		const int pollMS = 50;
+		int shownPasses = 0;
+		while (!job.wait(pollMS))
+		  {
+			if (stopTrace) job.cancel();
+			sinceRefresh += pollMS;
+			// a progressive render is worth showing after every pass
+			if (sinceRefresh >= intervalMS || job.passesDone() > shownPasses)
 			  {
-			    for (int x = 0; x < width; x++)
-			      {
-					if (stopTrace) break;
-					// check for input and refresh view every so often while tracing
-					now = clock();
-					if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
-					  {
-					    prev = now;
-					    //sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-					    //pUI->m_traceGlWindow->label(buffer);
-					    pUI->m_traceGlWindow->refresh();
-					    Fl::check();
-					    if (Fl::damage()) { Fl::flush(); }
-				      }
-					// look for input and refresh window
-				    pUI->raytracer->tracePixel(x, y);
-					pUI->m_debuggingWindow->m_debuggingView->setDirty();
-			      }
-			    if (stopTrace) break;
+				sinceRefresh = 0;
+				shownPasses = job.passesDone();
+				print(buffer, "(%d%%) %s", (int)(job.progress() * 100.0), old_label);
+				pUI->m_traceGlWindow->label(buffer);
+				pUI->m_traceGlWindow->refresh();
+				pUI->m_debuggingWindow->m_debuggingView->setDirty();
 			  }
-		}
+			Fl::check();
+			if (Fl::damage()) { Fl::flush(); }
+		  }
 
-        //now2 = clock();
-        //cout << "time spent" << (now2 - prev2) / CLOCKS_PER_SEC * 1000 << endl;
         cout << "DONE" <<endl;
+
+		// the exposure slider moved during the render
+		if (pUI->m_exposure != exposure) pUI->raytracer->toneMapBuffer();
 		
 		stopTrace = false;
 		doneTrace = true;
@@ -333,7 +351,7 @@ void GraphicalUI::stopTracing()
 
 GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	// init.
-	m_mainWindow = new Fl_Window(100, 40, 450, 459, "Ray <Not Loaded>");
+	m_mainWindow = new Fl_Window(100, 40, 450, 484, "Ray <Not Loaded>");
 	m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 	// install menu bar
 	m_menubar = new Fl_Menu_Bar(0, 0, 440, 25);
@@ -424,6 +442,44 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_threadSlider->value(m_threadNum);
 	m_threadSlider->align(FL_ALIGN_RIGHT);
 	m_threadSlider->callback(cb_threadSlides);
+
+	m_aaThreshSlider = new Fl_Value_Slider(10, 190, 180, 20, "Adaptive AA Threshold");
+	m_aaThreshSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_aaThreshSlider->type(FL_HOR_NICE_SLIDER);
+	m_aaThreshSlider->labelfont(FL_COURIER);
+	m_aaThreshSlider->labelsize(12);
+	m_aaThreshSlider->minimum(0.0);
+	m_aaThreshSlider->maximum(0.5);
+	m_aaThreshSlider->step(0.01);
+	m_aaThreshSlider->value(m_aaThreshold);
+	m_aaThreshSlider->align(FL_ALIGN_RIGHT);
+	m_aaThreshSlider->callback(cb_aaThreshSlides);
+	m_aaThreshSlider->deactivate();
+
+	m_aaMaxSamplesSlider = new Fl_Value_Slider(10, 215, 180, 20, "Adaptive AA Sample Budget");
+	m_aaMaxSamplesSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_aaMaxSamplesSlider->type(FL_HOR_NICE_SLIDER);
+	m_aaMaxSamplesSlider->labelfont(FL_COURIER);
+	m_aaMaxSamplesSlider->labelsize(12);
+	m_aaMaxSamplesSlider->minimum(4);
+	m_aaMaxSamplesSlider->maximum(64);
+	m_aaMaxSamplesSlider->step(1);
+	m_aaMaxSamplesSlider->value(m_aaMaxSamples);
+	m_aaMaxSamplesSlider->align(FL_ALIGN_RIGHT);
+	m_aaMaxSamplesSlider->callback(cb_aaMaxSamplesSlides);
+	m_aaMaxSamplesSlider->deactivate();
+
+	m_exposureSlider = new Fl_Value_Slider(10, 240, 180, 20, "Exposure (stops)");
+	m_exposureSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_exposureSlider->type(FL_HOR_NICE_SLIDER);
+	m_exposureSlider->labelfont(FL_COURIER);
+	m_exposureSlider->labelsize(12);
+	m_exposureSlider->minimum(-4.0);
+	m_exposureSlider->maximum(4.0);
+	m_exposureSlider->step(0.1);
+	m_exposureSlider->value(m_exposure);
+	m_exposureSlider->align(FL_ALIGN_RIGHT);
+	m_exposureSlider->callback(cb_exposureSlides);
 	// set up debugging display checkbox
 	
 	m_debuggingDisplayCheckButton = new Fl_Check_Button(10, 429, 140, 20, "Debugging display");
@@ -436,12 +492,37 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_cubeMapCheckButton->callback(cb_cubeMapCheckButton);
 	m_cubeMapCheckButton->value(m_usingCubeMap);
 	m_cubeMapCheckButton->deactivate();
-/*
-	m_kdCheckButton = new Fl_Check_Button(320, 429, 140, 20, "Use KdTree");
+
+	m_kdCheckButton = new Fl_Check_Button(10, 404, 140, 20, "Use KdTree");
 	m_kdCheckButton->user_data((void*)(this));
 	m_kdCheckButton->callback(cb_kdCheckButton);
 	m_kdCheckButton->value(m_useKdTree);
-*/
+
+	m_sahCheckButton = new Fl_Check_Button(150, 404, 140, 20, "SAH KdTree");
+	m_sahCheckButton->user_data((void*)(this));
+	m_sahCheckButton->callback(cb_sahCheckButton);
+	m_sahCheckButton->value(m_kdSplit == KD_SPLIT_SAH);
+
+	m_aaCheckButton = new Fl_Check_Button(290, 404, 140, 20, "Adaptive AA");
+	m_aaCheckButton->user_data((void*)(this));
+	m_aaCheckButton->callback(cb_aaCheckButton);
+	m_aaCheckButton->value(m_adaptiveAA);
+
+	m_progressiveCheckButton = new Fl_Check_Button(290, 429, 140, 20, "Progressive");
+	m_progressiveCheckButton->user_data((void*)(this));
+	m_progressiveCheckButton->callback(cb_progressiveCheckButton);
+	m_progressiveCheckButton->value(m_progressive);
+
+	m_packetCheckButton = new Fl_Check_Button(10, 454, 140, 20, "Ray packets");
+	m_packetCheckButton->user_data((void*)(this));
+	m_packetCheckButton->callback(cb_packetCheckButton);
+	m_packetCheckButton->value(m_packetSize > 1);
+
+	m_wavefrontCheckButton = new Fl_Check_Button(150, 454, 140, 20, "Wavefront");
+	m_wavefrontCheckButton->user_data((void*)(this));
+	m_wavefrontCheckButton->callback(cb_wavefrontCheckButton);
+	m_wavefrontCheckButton->value(m_wavefront);
+
 	m_cubeMapChooser = new CubeMapChooser();
 	m_cubeMapChooser->setCaller(this);
 
@@ -40,15 +40,21 @@ public:
 	Fl_Slider*			m_blockSlider;
 	Fl_Slider*			m_aaSamplesSlider;
 	Fl_Slider*			m_aaThreshSlider;
+	Fl_Slider*			m_aaMaxSamplesSlider;
 	Fl_Slider*			m_refreshSlider;
 	Fl_Slider*			m_treeDepthSlider;
 	Fl_Slider*			m_leafSizeSlider;
 	Fl_Slider*			m_filterSlider;
 	Fl_Slider*			m_threadSlider;
+	Fl_Slider*			m_exposureSlider;
 
 	Fl_Check_Button*	m_debuggingDisplayCheckButton;
 	Fl_Check_Button*	m_aaCheckButton;
+	Fl_Check_Button*	m_progressiveCheckButton;
+	Fl_Check_Button*	m_packetCheckButton;
+	Fl_Check_Button*	m_wavefrontCheckButton;
 	Fl_Check_Button*	m_kdCheckButton;
+	Fl_Check_Button*	m_sahCheckButton;
 	Fl_Check_Button*	m_cubeMapCheckButton;
 	Fl_Check_Button*	m_ssCheckButton;
 	Fl_Check_Button*	m_shCheckButton;
@@ -66,7 +72,6 @@ public:
 	// member functions
 	void setRayTracer(RayTracer *tracer);
 	RayTracer* getRayTracer() { return raytracer; }
-	static void thread_trace(int xStart, int xEnd, int yStart, int yEnd, GraphicalUI* pUI);
 
 	static void stopTracing();
 
@@ -94,8 +99,11 @@ private:
 	static void cb_depthSlides(Fl_Widget* o, void* v);
 	static void cb_refreshSlides(Fl_Widget* o, void* v);
 	static void cb_aaSlides(Fl_Widget* o, void* v);
+	static void cb_aaThreshSlides(Fl_Widget* o, void* v);
+	static void cb_aaMaxSamplesSlides(Fl_Widget* o, void* v);
 	static void cb_filterSlides(Fl_Widget* o, void* v);
 	static void cb_threadSlides(Fl_Widget* o, void* v);
+	static void cb_exposureSlides(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);
@@ -103,7 +111,12 @@ private:
 	static void cb_ssCheckButton(Fl_Widget* o, void* v);
 	static void cb_shCheckButton(Fl_Widget* o, void* v);
 	static void cb_kdCheckButton(Fl_Widget* o, void* v);
+	static void cb_sahCheckButton(Fl_Widget* o, void* v);
 	static void cb_bfCheckButton(Fl_Widget* o, void* v);
+	static void cb_aaCheckButton(Fl_Widget* o, void* v);
+	static void cb_progressiveCheckButton(Fl_Widget* o, void* v);
+	static void cb_packetCheckButton(Fl_Widget* o, void* v);
+	static void cb_wavefrontCheckButton(Fl_Widget* o, void* v);
 	static void cb_cubeMapCheckButton(Fl_Widget* o, void* v);
 	static void cb_load_cubemap(Fl_Menu_* o, void* v);
 
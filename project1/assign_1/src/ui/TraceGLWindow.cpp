@@ -2,12 +2,17 @@
 // A subclass of FL_GL_Window that handles drawing the traced image to the screen
 // 
 #include <iostream>
+#include <string.h>
+#include <vector>
+
+#include <FL/fl_ask.H>
 
 #include "TraceGLWindow.h"
 #include "../RayTracer.h"
 #include "GraphicalUI.h"
 
 #include "../fileio/bitmap.h"
+#include "../fileio/pfm.h"
 
 extern bool debugMode;
 extern TraceUI* traceUI;
@@ -112,12 +117,22 @@ void TraceGLWindow::resizeWindow(int width, int height)
 	m_nWindowHeight=h();
 }
 
+// A name ending in .pfm saves the linear framebuffer instead of the
+// tone mapped image.
 void TraceGLWindow::saveImage(char *iname)
 {
 	unsigned char* buf;
 
 	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	if (buf)
+	if (!buf) return;
+
+	size_t len = strlen(iname);
+	if (len > 4 && !strcmp(iname + len - 4, ".pfm")) {
+		std::vector<float> linear;
+		raytracer->getLinearImage(linear);
+		if (!writePFM(iname, m_nDrawWidth, m_nDrawHeight, &linear[0]))
+			fl_alert("Unable to write %s", iname);
+	} else
 		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
 }
 
@@ -17,12 +17,18 @@ using std::string;
 
 class RayTracer;
 
+// How KdTree picks its splitting planes (see scene/kdtree.h).
+enum KdSplitMethod { KD_SPLIT_MIDPOINT, KD_SPLIT_SAH };
+
 class TraceUI {
 public:
-	TraceUI() : m_nDepth(0), m_nSize(512), m_displayDebuggingInfo(false),
-                    m_shadows(true), m_smoothshade(true), raytracer(0),
-                    m_nFilterWidth(1), m_aaSize(1), m_gotCubeMap(false),
-                    m_usingCubeMap(false)
+	TraceUI() : raytracer(0), m_nSize(512), m_nDepth(0), m_aaSize(1),
+                    m_adaptiveAA(false), m_aaThreshold(0.1), m_aaMaxSamples(64),
+                    m_progressive(false), m_exposure(0.0), m_packetSize(1), m_wavefront(false),
+                    m_tileSize(16), m_displayDebuggingInfo(false),
+                    m_shadows(true), m_smoothshade(true),
+                    m_usingCubeMap(false), m_gotCubeMap(false), m_useKdTree(true),
+                    m_kdSplit(KD_SPLIT_SAH), m_nFilterWidth(1)
                     {
                     	m_threadNum = std::thread::hardware_concurrency();
                     	//m_threadNum = 8;
@@ -42,7 +48,15 @@ public:
 	int	getSize() const { return m_nSize; }
 	int	getDepth() const { return m_nDepth; }
 	int getThreadNum() const {return m_threadNum; };
+	int getTileSize() const { return m_tileSize; }
 	int getAASize() const { return m_aaSize; }
+	bool adaptiveAA() const { return m_adaptiveAA; }
+	double getAAThreshold() const { return m_aaThreshold; }
+	int getAAMaxSamples() const { return m_aaMaxSamples; }
+	bool progressive() const { return m_progressive; }
+	double getExposure() const { return m_exposure; }
+	int getPacketSize() const { return m_packetSize; }
+	bool wavefront() const { return m_wavefront; }
 	int		getFilterWidth() const { return m_nFilterWidth; }
 
 	bool	shadowSw() const { return m_shadows; }
@@ -50,7 +64,8 @@ public:
 
 	bool useCubeMap() const { return m_usingCubeMap; }
 	bool gotCubeMap() const { return m_gotCubeMap; }
-	bool useKdTree() const { return true; }
+	bool useKdTree() const { return m_useKdTree; }
+	KdSplitMethod getKdSplit() const { return m_kdSplit; }
 
 	static bool m_debug;
 
@@ -60,7 +75,15 @@ protected:
 	int	m_nSize;	// Size of the traced image
 	int	m_nDepth;	// Max depth of recursion
 	int m_aaSize;
+	bool m_adaptiveAA;  // refine only where samples differ (see RayTracer::adaptiveBlock)
+	double m_aaThreshold;  // colour difference that triggers refinement
+	int m_aaMaxSamples;  // the render's average per pixel, for adaptive anti-aliasing
+	bool m_progressive;  // render in refining passes (see RenderJob)
+	double m_exposure;  // in stops, applied when the image is tone mapped
+	int m_packetSize;  // trace camera rays in packets of this squared; below 2, singly
+	bool m_wavefront;  // trace tiles breadth first (see Wavefront.h)
 	int m_threadNum;
+	int m_tileSize;  // edge of the square tiles handed to render threads
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
@@ -70,7 +93,8 @@ protected:
 	bool m_smoothshade;  // turn on/off smoothshading?
 	bool m_usingCubeMap;  // render with cubemap
 	bool m_gotCubeMap;  // cubemap defined
-	//bool m_useKdTree;
+	bool m_useKdTree;  // intersect through the kd-tree at all?
+	KdSplitMethod m_kdSplit;  // how to build it
 	int m_nFilterWidth;  // width of cubemap filter
 };
 
@@ -363,9 +363,9 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 
 			if( normals.empty() )
 			{
-				const Vec3d& a = vertices[vert1];
-				const Vec3d& b = vertices[vert2];
-				const Vec3d& c = vertices[vert3];
+				Vec3d a = vertex(vert1);
+				Vec3d b = vertex(vert2);
+				Vec3d c = vertex(vert3);
 
 				Vec3d cv=(b - a) ^ (c - a);
 
@@ -376,22 +376,22 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 			}
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert1].getPointer() );
+				glNormal3fv( normals[vert1].getPointer() );
 			if( !materials.empty() && actualMaterials )
 				setGLMaterial( *materials[vert1], *itr );
-			glVertex3dv( vertices[vert1].getPointer() );
+			glVertex3fv( vertices[vert1].getPointer() );
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert2].getPointer() );
+				glNormal3fv( normals[vert2].getPointer() );
 			if( !materials.empty() && actualMaterials )
 				setGLMaterial( *materials[vert2], *itr );
-			glVertex3dv( vertices[vert2].getPointer() );
+			glVertex3fv( vertices[vert2].getPointer() );
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert3].getPointer() );
+				glNormal3fv( normals[vert3].getPointer() );
 			if( !materials.empty() && actualMaterials )
 				setGLMaterial( *materials[vert3], *itr );
-			glVertex3dv( vertices[vert3].getPointer() );
+			glVertex3fv( vertices[vert3].getPointer() );
 		}
 		glEnd();
 
@@ -0,0 +1,274 @@
+#ifndef __SIMD_HEADER__
+#define __SIMD_HEADER__
+
+// SSE/AVX versions of the vecmath types, for code that does the same
+// arithmetic over many vectors.
+//
+// Vec3<T> keeps its three unpadded elements, since meshes store millions
+// of them; the types here are for registers and locals instead.  Vec4fx
+// is a Vec3f (w = 0) or Vec4f in one SSE register; Vec4dx is a Vec3d or
+// Vec4d in one AVX register, or two SSE2 ones.  Without SSE2 both are
+// plain arrays.
+//
+// Each operation computes what the corresponding operator of vec.h does,
+// term for term and in the same order, so swapping one for the other
+// never changes a result.  The batched products at the end (Mat4 * Vec4,
+// Mat3 * Vec3 and the affine map m * v + t, over arrays) are built on
+// them the same way; "make microbench" times them against the templates.
+// Those are where the registers pay off: a lone dot or cross product
+// spends more on shuffles and the horizontal sum than it saves.
+
+#include "vec.h"
+#include "mat.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//==========[ class Vec4fx ]===============================
+
+class Vec4fx {
+public:
+#if defined(__SSE2__)
+	__m128	v;
+
+	Vec4fx() : v(_mm_setzero_ps()) {}
+	Vec4fx( __m128 x ) : v(x) {}
+	Vec4fx( float x, float y, float z, float w = 0.0f ) : v(_mm_setr_ps(x, y, z, w)) {}
+	explicit Vec4fx( float s ) : v(_mm_set1_ps(s)) {}
+
+	void store( float* p ) const { _mm_storeu_ps(p, v); }
+	static Vec4fx load( const float* p ) { return _mm_loadu_ps(p); }
+
+	Vec4fx operator +( const Vec4fx& a ) const { return _mm_add_ps(v, a.v); }
+	Vec4fx operator -( const Vec4fx& a ) const { return _mm_sub_ps(v, a.v); }
+	// element-wise, as Vec3's %=
+	Vec4fx operator %( const Vec4fx& a ) const { return _mm_mul_ps(v, a.v); }
+	Vec4fx operator *( float d ) const { return _mm_mul_ps(v, _mm_set1_ps(d)); }
+	Vec4fx operator /( float d ) const { return _mm_div_ps(v, _mm_set1_ps(d)); }
+
+	friend Vec4fx minimum( const Vec4fx& a, const Vec4fx& b ) { return _mm_min_ps(a.v, b.v); }
+	friend Vec4fx maximum( const Vec4fx& a, const Vec4fx& b ) { return _mm_max_ps(a.v, b.v); }
+
+	// (y, z, x, w) and (z, x, y, w)
+	Vec4fx yzx() const { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1)); }
+	Vec4fx zxy() const { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2)); }
+#else
+	float	v[4];
+
+	Vec4fx() { v[0] = v[1] = v[2] = v[3] = 0.0f; }
+	Vec4fx( float x, float y, float z, float w = 0.0f ) { v[0] = x; v[1] = y; v[2] = z; v[3] = w; }
+	explicit Vec4fx( float s ) { v[0] = v[1] = v[2] = v[3] = s; }
+
+	void store( float* p ) const { memcpy(p, v, sizeof(v)); }
+	static Vec4fx load( const float* p ) { return Vec4fx(p[0], p[1], p[2], p[3]); }
+
+	Vec4fx operator +( const Vec4fx& a ) const { return Vec4fx(v[0]+a.v[0], v[1]+a.v[1], v[2]+a.v[2], v[3]+a.v[3]); }
+	Vec4fx operator -( const Vec4fx& a ) const { return Vec4fx(v[0]-a.v[0], v[1]-a.v[1], v[2]-a.v[2], v[3]-a.v[3]); }
+	Vec4fx operator %( const Vec4fx& a ) const { return Vec4fx(v[0]*a.v[0], v[1]*a.v[1], v[2]*a.v[2], v[3]*a.v[3]); }
+	Vec4fx operator *( float d ) const { return Vec4fx(v[0]*d, v[1]*d, v[2]*d, v[3]*d); }
+	Vec4fx operator /( float d ) const { return Vec4fx(v[0]/d, v[1]/d, v[2]/d, v[3]/d); }
+
+	friend Vec4fx minimum( const Vec4fx& a, const Vec4fx& b )
+		{ return Vec4fx(min(a.v[0],b.v[0]), min(a.v[1],b.v[1]), min(a.v[2],b.v[2]), min(a.v[3],b.v[3])); }
+	friend Vec4fx maximum( const Vec4fx& a, const Vec4fx& b )
+		{ return Vec4fx(max(a.v[0],b.v[0]), max(a.v[1],b.v[1]), max(a.v[2],b.v[2]), max(a.v[3],b.v[3])); }
+
+	Vec4fx yzx() const { return Vec4fx(v[1], v[2], v[0], v[3]); }
+	Vec4fx zxy() const { return Vec4fx(v[2], v[0], v[1], v[3]); }
+#endif
+
+	explicit Vec4fx( const Vec3f& a ) { *this = Vec4fx(a[0], a[1], a[2]); }
+	explicit Vec4fx( const Vec4f& a ) { *this = Vec4fx(a[0], a[1], a[2], a[3]); }
+
+	// Three elements only, so a Vec3f in an array is never overrun.
+	static Vec4fx load3( const float* p ) { return Vec4fx(p[0], p[1], p[2]); }
+	void store3( float* p ) const { float e[4]; store(e); p[0] = e[0]; p[1] = e[1]; p[2] = e[2]; }
+
+	Vec3f xyz() const { float e[4]; store(e); return Vec3f(e[0], e[1], e[2]); }
+	Vec4f xyzw() const { float e[4]; store(e); return Vec4f(e[0], e[1], e[2], e[3]); }
+	float operator []( int i ) const { float e[4]; store(e); return e[i]; }
+
+	// of x, y and z
+	friend float operator *( const Vec4fx& a, const Vec4fx& b )
+		{ float e[4]; (a % b).store(e); return e[0] + e[1] + e[2]; }
+	friend Vec4fx operator ^( const Vec4fx& a, const Vec4fx& b )
+		{ return (a.yzx() % b.zxy()) - (a.zxy() % b.yzx()); }
+	double length() const { return sqrt( double(*this * *this) ); }
+};
+
+//==========[ class Vec4dx ]===============================
+
+class Vec4dx {
+public:
+#if defined(__AVX__)
+	__m256d	v;
+
+	Vec4dx() : v(_mm256_setzero_pd()) {}
+	Vec4dx( __m256d x ) : v(x) {}
+	Vec4dx( __m128d lo, __m128d hi ) : v(_mm256_insertf128_pd(_mm256_castpd128_pd256(lo), hi, 1)) {}
+	Vec4dx( double x, double y, double z, double w = 0.0 ) : v(_mm256_setr_pd(x, y, z, w)) {}
+	explicit Vec4dx( double s ) : v(_mm256_set1_pd(s)) {}
+
+	__m128d lo() const { return _mm256_castpd256_pd128(v); }
+	__m128d hi() const { return _mm256_extractf128_pd(v, 1); }
+
+	void store( double* p ) const { _mm256_storeu_pd(p, v); }
+	static Vec4dx load( const double* p ) { return _mm256_loadu_pd(p); }
+
+	Vec4dx operator +( const Vec4dx& a ) const { return _mm256_add_pd(v, a.v); }
+	Vec4dx operator -( const Vec4dx& a ) const { return _mm256_sub_pd(v, a.v); }
+	Vec4dx operator %( const Vec4dx& a ) const { return _mm256_mul_pd(v, a.v); }
+	Vec4dx operator *( double d ) const { return _mm256_mul_pd(v, _mm256_set1_pd(d)); }
+	Vec4dx operator /( double d ) const { return _mm256_div_pd(v, _mm256_set1_pd(d)); }
+
+	friend Vec4dx minimum( const Vec4dx& a, const Vec4dx& b ) { return _mm256_min_pd(a.v, b.v); }
+	friend Vec4dx maximum( const Vec4dx& a, const Vec4dx& b ) { return _mm256_max_pd(a.v, b.v); }
+#elif defined(__SSE2__)
+	__m128d	l, h;	// (x, y) and (z, w)
+
+	Vec4dx() : l(_mm_setzero_pd()), h(_mm_setzero_pd()) {}
+	Vec4dx( __m128d lo, __m128d hi ) : l(lo), h(hi) {}
+	Vec4dx( double x, double y, double z, double w = 0.0 ) : l(_mm_setr_pd(x, y)), h(_mm_setr_pd(z, w)) {}
+	explicit Vec4dx( double s ) : l(_mm_set1_pd(s)), h(_mm_set1_pd(s)) {}
+
+	__m128d lo() const { return l; }
+	__m128d hi() const { return h; }
+
+	void store( double* p ) const { _mm_storeu_pd(p, l); _mm_storeu_pd(p + 2, h); }
+	static Vec4dx load( const double* p ) { return Vec4dx(_mm_loadu_pd(p), _mm_loadu_pd(p + 2)); }
+
+	Vec4dx operator +( const Vec4dx& a ) const { return Vec4dx(_mm_add_pd(l, a.l), _mm_add_pd(h, a.h)); }
+	Vec4dx operator -( const Vec4dx& a ) const { return Vec4dx(_mm_sub_pd(l, a.l), _mm_sub_pd(h, a.h)); }
+	Vec4dx operator %( const Vec4dx& a ) const { return Vec4dx(_mm_mul_pd(l, a.l), _mm_mul_pd(h, a.h)); }
+	Vec4dx operator *( double d ) const
+		{ __m128d s = _mm_set1_pd(d); return Vec4dx(_mm_mul_pd(l, s), _mm_mul_pd(h, s)); }
+	Vec4dx operator /( double d ) const
+		{ __m128d s = _mm_set1_pd(d); return Vec4dx(_mm_div_pd(l, s), _mm_div_pd(h, s)); }
+
+	friend Vec4dx minimum( const Vec4dx& a, const Vec4dx& b )
+		{ return Vec4dx(_mm_min_pd(a.l, b.l), _mm_min_pd(a.h, b.h)); }
+	friend Vec4dx maximum( const Vec4dx& a, const Vec4dx& b )
+		{ return Vec4dx(_mm_max_pd(a.l, b.l), _mm_max_pd(a.h, b.h)); }
+#else
+	double	v[4];
+
+	Vec4dx() { v[0] = v[1] = v[2] = v[3] = 0.0; }
+	Vec4dx( double x, double y, double z, double w = 0.0 ) { v[0] = x; v[1] = y; v[2] = z; v[3] = w; }
+	explicit Vec4dx( double s ) { v[0] = v[1] = v[2] = v[3] = s; }
+
+	void store( double* p ) const { memcpy(p, v, sizeof(v)); }
+	static Vec4dx load( const double* p ) { return Vec4dx(p[0], p[1], p[2], p[3]); }
+
+	Vec4dx operator +( const Vec4dx& a ) const { return Vec4dx(v[0]+a.v[0], v[1]+a.v[1], v[2]+a.v[2], v[3]+a.v[3]); }
+	Vec4dx operator -( const Vec4dx& a ) const { return Vec4dx(v[0]-a.v[0], v[1]-a.v[1], v[2]-a.v[2], v[3]-a.v[3]); }
+	Vec4dx operator %( const Vec4dx& a ) const { return Vec4dx(v[0]*a.v[0], v[1]*a.v[1], v[2]*a.v[2], v[3]*a.v[3]); }
+	Vec4dx operator *( double d ) const { return Vec4dx(v[0]*d, v[1]*d, v[2]*d, v[3]*d); }
+	Vec4dx operator /( double d ) const { return Vec4dx(v[0]/d, v[1]/d, v[2]/d, v[3]/d); }
+
+	friend Vec4dx minimum( const Vec4dx& a, const Vec4dx& b )
+		{ return Vec4dx(min(a.v[0],b.v[0]), min(a.v[1],b.v[1]), min(a.v[2],b.v[2]), min(a.v[3],b.v[3])); }
+	friend Vec4dx maximum( const Vec4dx& a, const Vec4dx& b )
+		{ return Vec4dx(max(a.v[0],b.v[0]), max(a.v[1],b.v[1]), max(a.v[2],b.v[2]), max(a.v[3],b.v[3])); }
+#endif
+
+	explicit Vec4dx( const Vec3d& a ) { *this = Vec4dx(a[0], a[1], a[2]); }
+	explicit Vec4dx( const Vec4d& a ) { *this = Vec4dx(a[0], a[1], a[2], a[3]); }
+
+	// Three elements only, so a Vec3d in an array is never overrun.
+	static Vec4dx load3( const double* p ) {
+#if defined(__SSE2__)
+		return Vec4dx(_mm_loadu_pd(p), _mm_load_sd(p + 2));
+#else
+		return Vec4dx(p[0], p[1], p[2]);
+#endif
+	}
+	void store3( double* p ) const {
+#if defined(__SSE2__)
+		_mm_storeu_pd(p, lo());
+		_mm_store_sd(p + 2, hi());
+#else
+		p[0] = v[0]; p[1] = v[1]; p[2] = v[2];
+#endif
+	}
+
+	Vec3d xyz() const { double e[4]; store(e); return Vec3d(e[0], e[1], e[2]); }
+	Vec4d xyzw() const { double e[4]; store(e); return Vec4d(e[0], e[1], e[2], e[3]); }
+	double operator []( int i ) const { double e[4]; store(e); return e[i]; }
+
+	// (y, z, x, w) and (z, x, y, w)
+#if defined(__SSE2__)
+	Vec4dx yzx() const { return Vec4dx(_mm_shuffle_pd(lo(), hi(), 1), _mm_shuffle_pd(lo(), hi(), 2)); }
+	Vec4dx zxy() const { return Vec4dx(_mm_shuffle_pd(hi(), lo(), 0), _mm_shuffle_pd(lo(), hi(), 3)); }
+#else
+	Vec4dx yzx() const { return Vec4dx(v[1], v[2], v[0], v[3]); }
+	Vec4dx zxy() const { return Vec4dx(v[2], v[0], v[1], v[3]); }
+#endif
+
+	// of x, y and z
+	friend double operator *( const Vec4dx& a, const Vec4dx& b )
+		{ double e[4]; (a % b).store(e); return e[0] + e[1] + e[2]; }
+	friend Vec4dx operator ^( const Vec4dx& a, const Vec4dx& b )
+		{ return (a.yzx() % b.zxy()) - (a.zxy() % b.yzx()); }
+	double length() const { return sqrt( *this * *this ); }
+};
+
+//==========[ Batched Products ]===========================
+
+// The register type for Vec3<T> and Vec4<T>.
+template <class T> struct Simd4;
+template <> struct Simd4<float> { typedef Vec4fx type; };
+template <> struct Simd4<double> { typedef Vec4dx type; };
+
+// out[k] = m * in[k] for k < n, as Mat4<T> * Vec4<T>.  in and out may be
+// the same array.
+template <class T>
+inline void mulArray( const Mat4<T>& m, const Vec4<T>* in, Vec4<T>* out, int n ) {
+	typedef typename Simd4<T>::type X;
+	// a column of m per element of the vector, summed in the operator's order
+	X c0(m.n[0], m.n[4], m.n[ 8], m.n[12]), c1(m.n[1], m.n[5], m.n[ 9], m.n[13]);
+	X c2(m.n[2], m.n[6], m.n[10], m.n[14]), c3(m.n[3], m.n[7], m.n[11], m.n[15]);
+	for( int k = 0; k < n; ++k ) {
+		const T* v = reinterpret_cast<const T*>(&in[k]);
+		X r = c0 * v[0] + c1 * v[1] + c2 * v[2] + c3 * v[3];
+		r.store(reinterpret_cast<T*>(&out[k]));
+	}
+}
+
+// out[k] = m * in[k] for k < n, as Mat3<T> * Vec3<T>: directions.
+template <class T>
+inline void transformVectors( const Mat3<T>& m, const Vec3<T>* in, Vec3<T>* out, int n ) {
+	typedef typename Simd4<T>::type X;
+	X c0(m.n[0], m.n[3], m.n[6]), c1(m.n[1], m.n[4], m.n[7]), c2(m.n[2], m.n[5], m.n[8]);
+	for( int k = 0; k < n; ++k ) {
+		const T* v = in[k].n;
+		X r = c0 * v[0] + c1 * v[1] + c2 * v[2];
+		r.store3(out[k].n);
+	}
+}
+
+// out[k] = m * in[k] + t for k < n, as the operators compute it: points.
+template <class T>
+inline void transformPoints( const Mat3<T>& m, const Vec3<T>& t, const Vec3<T>* in, Vec3<T>* out, int n ) {
+	typedef typename Simd4<T>::type X;
+	X c0(m.n[0], m.n[3], m.n[6]), c1(m.n[1], m.n[4], m.n[7]), c2(m.n[2], m.n[5], m.n[8]);
+	X c3(t);
+	for( int k = 0; k < n; ++k ) {
+		const T* v = in[k].n;
+		X r = c0 * v[0] + c1 * v[1] + c2 * v[2] + c3;
+		r.store3(out[k].n);
+	}
+}
+
+// out[k] = m * in[k] for k < n, as Mat4<T> * Vec3<T> (w = 1, no divide).
+template <class T>
+inline void transformPoints( const Mat4<T>& m, const Vec3<T>* in, Vec3<T>* out, int n ) {
+	Mat3<T> linear(m.n[0], m.n[1], m.n[ 2],
+	               m.n[4], m.n[5], m.n[ 6],
+	               m.n[8], m.n[9], m.n[10]);
+	transformPoints(linear, Vec3<T>(m.n[3], m.n[7], m.n[11]), in, out, n);
+}
+
+#endif